@@ -6,9 +6,8 @@
 
 #include <stdlib.h>
 #include <string.h>
-#include <stdio.h>
+#include <stdint.h>
 #include <unistd.h>
-#include <assert.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
@@ -43,33 +42,60 @@ struct client *client_init(const char *path) {
   return res;
 }
 
-void client_send(const struct client *client, const char *msg, const size_t len) {
-  write(client->fd, msg, len);
+int client_send(const struct client *client, const char *msg, const size_t len) {
+  size_t off = 0;
+  while (off < len) {
+    const ssize_t wr = write(client->fd, msg + off, len - off);
+    if (wr <= 0) return -1;
+    off += wr;
+  }
+  return 0;
 }
 
-size_t client_read_sync(const struct client *client, char **buf) {
-  char buffer[1024];
-  size_t rd = read(client->fd, buffer, sizeof(buffer));
-  printf("(read %lu bytes)\n", rd);
+int client_send_command(const struct client *client, const char *cmd, const size_t len) {
+  char header[CLIENT_HEADER_SIZE] = { 'K', '8', '0', '8' };
+  const uint32_t l = len;
+  memcpy(header + 4, &l, sizeof(l));
+  if (client_send(client, header, sizeof(header)) < 0) return -1;
+  return client_send(client, cmd, len);
+}
 
-  if (rd == -1) {
-    *buf = NULL;
-    return 0;
+static int read_exact(const struct client *client, char *buf, const size_t len) {
+  size_t off = 0;
+  while (off < len) {
+    const ssize_t rd = read(client->fd, buf + off, len - off);
+    if (rd <= 0) return -1;
+    off += rd;
   }
+  return 0;
+}
 
-  *buf = malloc(rd);
-  memcpy(*buf, buffer, rd);
-  size_t curr_len = rd;
-  while (rd == 1024) {
-    rd = read(client->fd, buffer, sizeof(buffer));
-    char *cp = realloc(*buf, curr_len + rd);
-    if (cp != NULL) *buf = cp;
-    memcpy(*buf + curr_len, buffer, rd);
-    curr_len += rd;
-    printf("(read %lu bytes; buffer %lu bytes)\n", rd, curr_len);
+ssize_t client_read_frame(const struct client *client, char **buf) {
+  *buf = NULL;
+  char header[CLIENT_HEADER_SIZE];
+  if (read_exact(client, header, sizeof(header)) < 0) return -1;
+  if (header[0] != 'K' || header[1] != '8') return -1;
+
+  uint32_t len;
+  memcpy(&len, header + 4, sizeof(len));
+  *buf = malloc(CLIENT_HEADER_SIZE + len + 1);
+  if (*buf == NULL) return -1;
+  memcpy(*buf, header, sizeof(header));
+  if (read_exact(client, *buf + CLIENT_HEADER_SIZE, len) < 0) {
+    free(*buf);
+    *buf = NULL;
+    return -1;
   }
 
-  return curr_len;
+  (*buf)[CLIENT_HEADER_SIZE + len] = '\0';
+  return CLIENT_HEADER_SIZE + len;
+}
+
+ssize_t client_read_sync(const struct client *client, char **buf) {
+  const ssize_t len = client_read_frame(client, buf);
+  if (len < 0) return -1;
+  memmove(*buf, *buf + CLIENT_HEADER_SIZE, len - CLIENT_HEADER_SIZE + 1);
+  return len - CLIENT_HEADER_SIZE;
 }
 
 void client_free(struct client *client) {
@@ -6,12 +6,17 @@
 #define CLIENT_H
 
 #include <stddef.h>
+#include <sys/types.h>
+
+#define CLIENT_HEADER_SIZE 8
 
 struct client;
 
 struct client *client_init(const char *path);
-void client_send(const struct client *client, const char *msg, size_t len);
-size_t client_read_sync(const struct client *client, char **buf);
+int client_send(const struct client *client, const char *msg, size_t len);
+int client_send_command(const struct client *client, const char *cmd, size_t len);
+ssize_t client_read_frame(const struct client *client, char **buf);
+ssize_t client_read_sync(const struct client *client, char **buf);
 void client_free(struct client *client);
 
 #endif //CLIENT_H
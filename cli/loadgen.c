@@ -0,0 +1,131 @@
+//
+// Created by jay on 1/5/25.
+//
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "client.h"
+
+#ifndef K808_SERVER
+#error "K808_SERVER is not defined. Expected a file path."
+#endif
+
+struct worker {
+  pthread_t thread;
+  const char *message;
+  int requests;
+  int window;
+  uint64_t *latencies; // ns, one per request
+  int completed;
+  int failed;
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *run_worker(void *_args) {
+  struct worker *w = _args;
+  struct client *client = client_init(K808_SERVER);
+  if (client == NULL) {
+    w->failed = 1;
+    return NULL;
+  }
+
+  const size_t len = strlen(w->message);
+  uint64_t *sent_at = malloc(w->requests * sizeof(uint64_t));
+  int sent = 0;
+  while (w->completed < w->requests) {
+    while (sent < w->requests && sent - w->completed < w->window) {
+      sent_at[sent] = now_ns();
+      if (client_send_command(client, w->message, len) < 0) goto done;
+      sent++;
+    }
+
+    char *resp = NULL;
+    if (client_read_sync(client, &resp) < 0) goto done;
+    free(resp);
+    w->latencies[w->completed] = now_ns() - sent_at[w->completed];
+    w->completed++;
+  }
+
+done:
+  if (w->completed < w->requests) w->failed = 1;
+  free(sent_at);
+  client_free(client);
+  return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void usage(void) {
+  printf("Usage: k808-loadgen [-c connections] [-n requests] [-w window] [-m message]\n");
+  printf("  Opens <connections> concurrent connections (default 16), each pipelining <requests> (default 1000)\n");
+  printf("  copies of <message> (default 'ping') with at most <window> (default 32) outstanding.\n");
+}
+
+int main(const int argc, char **argv) {
+  int connections = 16, requests = 1000, window = 32;
+  const char *message = "ping";
+
+  int opt;
+  while ((opt = getopt(argc, argv, "hc:n:w:m:")) != -1) {
+    switch (opt) {
+      case 'c': connections = atoi(optarg); break;
+      case 'n': requests = atoi(optarg); break;
+      case 'w': window = atoi(optarg); break;
+      case 'm': message = optarg; break;
+      case 'h': usage(); return EXIT_SUCCESS;
+      default: usage(); return EXIT_FAILURE;
+    }
+  }
+  if (connections <= 0 || requests <= 0 || window <= 0) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  struct worker *workers = calloc(connections, sizeof(struct worker));
+  const uint64_t start = now_ns();
+  for (int i = 0; i < connections; i++) {
+    workers[i].message = message;
+    workers[i].requests = requests;
+    workers[i].window = window;
+    workers[i].latencies = malloc(requests * sizeof(uint64_t));
+    pthread_create(&workers[i].thread, NULL, run_worker, workers + i);
+  }
+
+  uint64_t *all = malloc((size_t)connections * requests * sizeof(uint64_t));
+  size_t total = 0;
+  int failed = 0;
+  for (int i = 0; i < connections; i++) {
+    pthread_join(workers[i].thread, NULL);
+    memcpy(all + total, workers[i].latencies, workers[i].completed * sizeof(uint64_t));
+    total += workers[i].completed;
+    failed += workers[i].failed;
+    free(workers[i].latencies);
+  }
+  const uint64_t elapsed = now_ns() - start;
+
+  printf("connections: %d (%d failed), window: %d, message: '%s'\n", connections, failed, window, message);
+  printf("completed:   %lu requests in %.3f s (%.0f req/s)\n", total, (double)elapsed / 1e9, total / ((double)elapsed / 1e9));
+  if (total > 0) {
+    qsort(all, total, sizeof(uint64_t), compare_u64);
+    printf("latency:     p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n",
+      all[total / 2] / 1e3, all[total * 9 / 10] / 1e3, all[total * 99 / 100] / 1e3, all[total - 1] / 1e3);
+  }
+
+  free(all);
+  free(workers);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -6,54 +6,386 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "client.h"
+#include "protocol.h"
 
 #ifndef K808_SERVER
 #error "K808_SERVER is not defined. Expected a file path."
 #endif
 
+#define DEFAULT_WINDOW 64
+
+struct commands {
+  char **items;
+  int count;
+  int cap;
+};
+
+// One v2 frame carrying commands [first, first + count).
+struct batch {
+  char *frame;
+  size_t len;
+  uint32_t id;
+  int first;
+  int count;
+};
+
+static const char *key_names[] = { "0", "1", "2", "3", "4", "5", "6", "7", "8", "9", "DOT", "ENTER" };
+
 void help() {
-  // TODO
-  printf(" --- TODO! --- \n");
+  printf("Usage: k808-cli [-2] [-w window] [-f file|-] [command...]\n");
+  printf("  Without commands or -f, starts an interactive prompt.\n");
+  printf("  Commands from the arguments, then from the file (or stdin for '-'), are pipelined over one connection;\n");
+  printf("  at most <window> (default %d) requests are outstanding at any time. Responses are printed in order.\n", DEFAULT_WINDOW);
+  printf("  With -2, commands are sent as binary v2 batches, packing as many commands per message as fit.\n");
+  printf("  Results too large for their batch's response are fetched again on their own.\n");
+  printf("Commands:\n");
+  printf("  ping    check whether the daemon is responsive\n");
+  printf("  quit    stop the daemon\n");
+  printf("  stats   show call counts, timings and overruns of every handler\n");
+  printf("  metrics show the daemon's counters in Prometheus text format\n");
+  printf("Commands (-2 only):\n");
+  printf("  state                        show the layer of every device\n");
+  printf("  layer <n> [device]           switch all devices (or one) to layer <n>\n");
+  printf("  push <n> / pop               push or pop a layer on all devices\n");
+  printf("  remap <layer> <key> <codes>  make <key> (0-9, DOT, ENTER) send the comma-separated key codes\n");
+  printf("Prompt: '.h' for this help, '.q' to quit.\n");
 }
 
-void command(const struct client *client, const char buf[1024]) {
-  char buffer[1032] = { 'K', '8', '0', '8' };
-  const size_t l = strlen(buf);
-  *(uint32_t *)(buffer + 4) = (uint32_t)l;
-  strncpy(buffer + 8, buf, l);
-  buffer[l] = '\0';
-  client_send(client, buffer, l);
+static void add_command(struct commands *cmds, const char *cmd) {
+  if (cmds->count == cmds->cap) {
+    cmds->cap = cmds->cap == 0 ? 16 : cmds->cap * 2;
+    char **copy = realloc(cmds->items, cmds->cap * sizeof(char *));
+    if (copy == NULL) return;
+    cmds->items = copy;
+  }
+  cmds->items[cmds->count++] = strdup(cmd);
+}
+
+// Reads one command per line; blank lines and lines starting with '#' are skipped.
+static int read_commands(struct commands *cmds, const char *path) {
+  FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  if (fp == NULL) {
+    perror(path);
+    return -1;
+  }
+
+  char line[1024];
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#') continue;
+    add_command(cmds, line);
+  }
+
+  if (fp != stdin) fclose(fp);
+  return 0;
+}
+
+static void free_commands(struct commands *cmds) {
+  for (int i = 0; i < cmds->count; i++) free(cmds->items[i]);
+  free(cmds->items);
+}
+
+void command(const struct client *client, const char *buf) {
+  if (client_send_command(client, buf, strlen(buf)) < 0) {
+    printf("Failed to send command.\n");
+    return;
+  }
 
   char *resp = NULL;
-  size_t rd = client_read_sync(client, &resp);
-  printf("(%lu bytes received)\n", rd);
-  if (rd == 0) {
+  const ssize_t rd = client_read_sync(client, &resp);
+  if (rd <= 0) {
     printf("No or empty response.\n");
   }
   else {
     printf("Server responded: '%s'\n", resp);
   }
+  free(resp);
 }
 
-int main() {
-  printf(" --- K808 CLI --- \n");
-  printf("Connecting to daemon...\n");
-  const struct client *client = client_init(K808_SERVER);
-  if (client == NULL) {
-    printf("Connection failed. Check if daemon is running.\n");
-    return EXIT_FAILURE;
+static int parse_key(const char *name) {
+  for (size_t i = 0; i < sizeof(key_names) / sizeof(key_names[0]); i++) {
+    if (strcmp(name, key_names[i]) == 0) return i;
+  }
+  return -1;
+}
+
+// Returns 0 on success, -1 if the command can't be parsed and -2 if it doesn't fit in the batch anymore.
+static int encode_command(struct proto_builder *b, const char *cmd) {
+  char op[32] = { 0 }, a1[32] = { 0 }, a2[32] = { 0 }, a3[256] = { 0 };
+  const int n = sscanf(cmd, "%31s %31s %31s %255s", op, a1, a2, a3);
+  uint32_t args[2];
+  int rc;
+
+  if (n == 1 && strcmp(op, "ping") == 0) rc = proto_add(b, PROTO_OP_PING, PROTO_OK, NULL, 0);
+  else if (n == 1 && strcmp(op, "quit") == 0) rc = proto_add(b, PROTO_OP_QUIT, PROTO_OK, NULL, 0);
+  else if (n == 1 && strcmp(op, "state") == 0) rc = proto_add(b, PROTO_OP_GET_STATE, PROTO_OK, NULL, 0);
+  else if (n == 1 && strcmp(op, "metrics") == 0) rc = proto_add(b, PROTO_OP_GET_METRICS, PROTO_OK, NULL, 0);
+  else if (n == 1 && strcmp(op, "stats") == 0) rc = proto_add(b, PROTO_OP_GET_STATS, PROTO_OK, NULL, 0);
+  else if (n == 1 && strcmp(op, "pop") == 0) rc = proto_add(b, PROTO_OP_POP_LAYER, PROTO_OK, NULL, 0);
+  else if (n == 2 && strcmp(op, "push") == 0) {
+    args[0] = atoi(a1);
+    rc = proto_add(b, PROTO_OP_PUSH_LAYER, PROTO_OK, args, sizeof(uint32_t));
+  }
+  else if ((n == 2 || n == 3) && strcmp(op, "layer") == 0) {
+    args[0] = n == 3 ? atoi(a2) : -1;
+    args[1] = atoi(a1);
+    rc = proto_add(b, PROTO_OP_SWITCH_LAYER, PROTO_OK, args, 2 * sizeof(uint32_t));
+  }
+  else if (n == 4 && strcmp(op, "remap") == 0 && parse_key(a2) >= 0) {
+    char data[2 * sizeof(uint32_t) + 16 * sizeof(uint16_t)];
+    args[0] = atoi(a1);
+    args[1] = parse_key(a2);
+    memcpy(data, args, sizeof(args));
+
+    int count = 0;
+    for (char *tok = strtok(a3, ","); tok != NULL && count < 16; tok = strtok(NULL, ",")) {
+      const uint16_t code = atoi(tok);
+      memcpy(data + sizeof(args) + count * sizeof(uint16_t), &code, sizeof(code));
+      count++;
+    }
+    rc = proto_add(b, PROTO_OP_REGISTER_REMAP, PROTO_OK, data, sizeof(args) + count * sizeof(uint16_t));
+  }
+  else return -1;
+
+  return rc < 0 ? -2 : 0;
+}
+
+static void print_result(const struct proto_entry *entry, const char *data) {
+  if (entry->opcode == PROTO_OP_GET_STATE && entry->length >= 3 * sizeof(uint32_t)) {
+    uint32_t state[3];
+    memcpy(state, data, sizeof(state));
+    printf("layers: %u, default layer: %u, devices: %u\n", state[0], state[1], state[2]);
+    for (uint32_t i = 0; i < state[2] && (3 + i + 1) * sizeof(uint32_t) <= entry->length; i++) {
+      uint32_t layer;
+      memcpy(&layer, data + (3 + i) * sizeof(uint32_t), sizeof(layer));
+      printf("  device %u: layer %u\n", i, layer);
+    }
+  }
+  else if (entry->opcode == PROTO_OP_GET_STATS) {
+    const int count = entry->length / sizeof(struct proto_handler_stats);
+    printf("%d handlers\n", count);
+    for (int i = 0; i < count; i++) {
+      struct proto_handler_stats s;
+      memcpy(&s, data + i * sizeof(s), sizeof(s));
+      const uint64_t calls = s.calls > 0 ? s.calls : 1;
+      const uint64_t samples = s.cpu_samples > 0 ? s.cpu_samples : 1;
+      if (s.layer < 0) printf("layer switch:");
+      else printf("layer %d key %s:", s.layer, s.key >= 0 && s.key < 12 ? key_names[s.key] : "?");
+      printf(" calls=%lu wall avg/max=%.1f/%.1f us cpu avg/max=%.1f/%.1f us overruns=%lu skipped=%lu%s\n",
+        s.calls, s.wall_ns / 1e3 / calls, s.wall_max_ns / 1e3, s.cpu_ns / 1e3 / samples, s.cpu_max_ns / 1e3,
+        s.overruns, s.skipped, s.quarantined ? " (quarantined)" : "");
+    }
+  }
+  else if (entry->opcode == PROTO_OP_GET_METRICS) printf("%.*s", (int)entry->length, data);
+  else if (entry->opcode == PROTO_OP_PING) printf("pong\n");
+  else printf("ok\n");
+}
+
+static struct batch *encode_batches(const struct commands *cmds, int *count) {
+  struct batch *batches = NULL;
+  *count = 0;
+  struct proto_builder b;
+
+  for (int i = 0; i < cmds->count; i++) {
+    if (*count == 0 || encode_command(&b, cmds->items[i]) == -2) {
+      if (*count > 0) batches[*count - 1].len = proto_finish(&b);
+      struct batch *copy = realloc(batches, (*count + 1) * sizeof(struct batch));
+      if (copy == NULL) break;
+      batches = copy;
+      struct batch *next = batches + (*count)++;
+      next->frame = malloc(PROTO_MAX_FRAME);
+      next->id = *count;
+      next->first = i;
+      next->count = 0;
+      proto_begin(&b, next->frame, PROTO_MAX_FRAME, next->id);
+      if (encode_command(&b, cmds->items[i]) < 0) goto invalid;
+    }
+    else if (proto_count(&b) == batches[*count - 1].count) goto invalid; // rejected by encode_command
+    batches[*count - 1].count++;
+  }
+  if (*count > 0) batches[*count - 1].len = proto_finish(&b);
+  return batches;
+
+invalid:
+  fprintf(stderr, "Can't parse command '%s'.\n", cmds->items[batches[*count - 1].first + batches[*count - 1].count]);
+  for (int i = 0; i < *count; i++) free(batches[i].frame);
+  free(batches);
+  *count = -1;
+  return NULL;
+}
+
+// Responses that arrived while an overflowed entry was being retried; they're handed out before reading any more.
+struct stash {
+  char *frames[256];
+  ssize_t lens[256];
+  int head;
+  int count;
+};
+
+static ssize_t next_response(const struct client *client, struct stash *stash, char **frame) {
+  if (stash->head == stash->count) return client_read_frame(client, frame);
+  *frame = stash->frames[stash->head];
+  return stash->lens[stash->head++];
+}
+
+// Runs a command that overflowed its batch on its own, in a frame of its own; only read-only commands overflow, so
+// running them again is safe. The responses still in flight come first, so they're read into the stash meanwhile.
+// Returns the command's status (its result is printed if it's PROTO_OK), or -1 if the connection failed.
+static int retry_command(const struct client *client, struct stash *stash, const int in_flight, const char *cmd,
+                         const uint32_t id) {
+  while (stash->count - stash->head < in_flight) {
+    if (stash->head > 0) {
+      memmove(stash->frames, stash->frames + stash->head, (stash->count - stash->head) * sizeof(char *));
+      memmove(stash->lens, stash->lens + stash->head, (stash->count - stash->head) * sizeof(ssize_t));
+      stash->count -= stash->head;
+      stash->head = 0;
+    }
+    if (stash->count == 256) return -1;
+    stash->lens[stash->count] = client_read_frame(client, stash->frames + stash->count);
+    if (stash->lens[stash->count] < 0) return -1;
+    stash->count++;
+  }
+
+  char buf[PROTO_MAX_FRAME];
+  struct proto_builder b;
+  proto_begin(&b, buf, sizeof(buf), id);
+  if (encode_command(&b, cmd) < 0 || client_send(client, buf, proto_finish(&b)) < 0) return -1;
+
+  char *frame = NULL;
+  const ssize_t len = client_read_frame(client, &frame);
+  struct proto_message resp;
+  size_t off = 0;
+  struct proto_entry entry;
+  const char *data;
+  int rc = -1;
+  if (len >= 0 && proto_parse(frame, len, &resp) == 0 && resp.request_id == id &&
+      proto_next(&resp, &off, &entry, &data) > 0) {
+    rc = entry.status;
+    if (rc == PROTO_OK) print_result(&entry, data);
+  }
+  free(frame);
+  return rc;
+}
+
+// Like run_batch, but each request is a v2 frame holding as many commands as fit; responses carry the request id.
+// Results that didn't fit in a response are fetched again one by one, so the output stays in order.
+static int run_batch_v2(const struct client *client, const struct commands *cmds, int window) {
+  int count;
+  struct batch *batches = encode_batches(cmds, &count);
+  if (count < 0) return EXIT_FAILURE;
+  if (window > 256) window = 256; // the stash holds whatever is in flight during a retry
+
+  struct stash stash = { 0 };
+  uint32_t retry_id = count;
+  int sent = 0;
+  int failed = 0;
+  for (int done = 0; done < count && !failed; done++) {
+    while (sent < count && sent - done < window) {
+      if (client_send(client, batches[sent].frame, batches[sent].len) < 0) {
+        fprintf(stderr, "Failed to send batch #%d.\n", sent + 1);
+        failed = 1;
+        break;
+      }
+      sent++;
+    }
+    if (failed) break;
+
+    char *frame = NULL;
+    const ssize_t len = next_response(client, &stash, &frame);
+    struct proto_message resp;
+    if (len < 0 || proto_parse(frame, len, &resp) < 0 || resp.request_id != batches[done].id) {
+      fprintf(stderr, "Invalid or missing response for batch #%d.\n", done + 1);
+      free(frame);
+      failed = 1;
+      break;
+    }
+
+    size_t off = 0;
+    struct proto_entry entry;
+    const char *data;
+    if (proto_next(&resp, &off, &entry, &data) > 0 && entry.status == PROTO_ERR_MALFORMED) {
+      fprintf(stderr, "Batch #%d was rejected as malformed; none of its commands ran.\n", done + 1);
+      free(frame);
+      failed = 1;
+      break;
+    }
+    off = 0;
+    for (int i = 0; i < batches[done].count; i++) {
+      const int cmd = batches[done].first + i;
+      if (proto_next(&resp, &off, &entry, &data) <= 0) {
+        fprintf(stderr, "Response for batch #%d is missing entries.\n", done + 1);
+        failed = 1;
+        break;
+      }
+      int status = entry.status;
+      if (status == PROTO_ERR_OVERFLOW) {
+        status = retry_command(client, &stash, sent - done - 1, cmds->items[cmd], ++retry_id);
+        if (status < 0) {
+          fprintf(stderr, "Connection lost while retrying command #%d '%s'.\n", cmd + 1, cmds->items[cmd]);
+          failed = 1;
+          break;
+        }
+        if (status == PROTO_OK) continue;
+      }
+      if (status != PROTO_OK) {
+        printf("error: %s\n", proto_status_name(status));
+        fprintf(stderr, "Command #%d '%s' failed: %s\n", cmd + 1, cmds->items[cmd], proto_status_name(status));
+        failed = 1;
+      }
+      else print_result(&entry, data);
+    }
+    free(frame);
+  }
+
+  while (stash.head < stash.count) free(stash.frames[stash.head++]);
+  for (int i = 0; i < count; i++) free(batches[i].frame);
+  free(batches);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Keeps up to `window` requests in flight; the daemon answers in order, so responses match requests by position.
+static int run_batch(const struct client *client, const struct commands *cmds, const int window) {
+  int sent = 0;
+  int failed = 0;
+  for (int done = 0; done < cmds->count; done++) {
+    while (sent < cmds->count && sent - done < window) {
+      if (client_send_command(client, cmds->items[sent], strlen(cmds->items[sent])) < 0) {
+        fprintf(stderr, "Failed to send command #%d '%s'.\n", sent + 1, cmds->items[sent]);
+        return EXIT_FAILURE;
+      }
+      sent++;
+    }
+
+    char *resp = NULL;
+    if (client_read_sync(client, &resp) < 0) {
+      fprintf(stderr, "Connection lost after %d of %d responses.\n", done, cmds->count);
+      return EXIT_FAILURE;
+    }
+
+    printf("%s\n", resp);
+    if (strncmp(resp, "error", 5) == 0) {
+      fprintf(stderr, "Command #%d '%s' failed: %s\n", done + 1, cmds->items[done], resp);
+      failed = 1;
+    }
+    free(resp);
   }
 
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void interactive(const struct client *client) {
   printf("Connected to daemon.\n");
   printf("Type '.h' for help, '.q' to quit.\n");
   while (1) {
     char buffer[1024];
     printf(">>> ");
     fflush(stdout);
-    int rd = scanf("%1023s", buffer);
-    if (rd == EOF) break;
+    if (fgets(buffer, sizeof(buffer), stdin) == NULL) break;
+    buffer[strcspn(buffer, "\r\n")] = '\0';
+    if (buffer[0] == '\0') continue;
 
     if (strcmp(buffer, ".q") == 0) break;
 
@@ -64,4 +396,58 @@ int main() {
       command(client, buffer);
     }
   }
-}
\ No newline at end of file
+}
+
+int main(const int argc, char **argv) {
+  struct commands cmds = { 0 };
+  int window = DEFAULT_WINDOW;
+  int batch = 0;
+  int binary = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "h2w:f:")) != -1) {
+    switch (opt) {
+      case '2':
+        binary = 1;
+        break;
+      case 'w':
+        window = atoi(optarg);
+        if (window <= 0) window = 1;
+        break;
+      case 'f':
+        if (read_commands(&cmds, optarg) < 0) return EXIT_FAILURE;
+        batch = 1;
+        break;
+      case 'h':
+        help();
+        return EXIT_SUCCESS;
+      default:
+        help();
+        return EXIT_FAILURE;
+    }
+  }
+  for (int i = optind; i < argc; i++) {
+    add_command(&cmds, argv[i]);
+    batch = 1;
+  }
+
+  if (!batch) {
+    printf(" --- K808 CLI --- \n");
+    printf("Connecting to daemon...\n");
+  }
+  struct client *client = client_init(K808_SERVER);
+  if (client == NULL) {
+    fprintf(stderr, "Connection failed. Check if daemon is running.\n");
+    free_commands(&cmds);
+    return EXIT_FAILURE;
+  }
+
+  int res = EXIT_SUCCESS;
+  if (batch && binary) res = run_batch_v2(client, &cmds, window);
+  else if (batch) res = run_batch(client, &cmds, window);
+  else interactive(client);
+
+  client_free(client);
+  free_commands(&cmds);
+  return res;
+}
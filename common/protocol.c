@@ -0,0 +1,102 @@
+//
+// Created by jay on 1/11/25.
+//
+
+#include "protocol.h"
+
+#include <string.h>
+
+void proto_begin(struct proto_builder *b, char *buf, const size_t cap, const uint32_t request_id) {
+  b->buf = buf;
+  b->cap = cap;
+  b->len = sizeof(struct proto_header);
+  b->failed = cap < sizeof(struct proto_header);
+  if (b->failed) return;
+
+  struct proto_header header = { .version = PROTO_VERSION, .flags = 0, .count = 0, .request_id = request_id };
+  memcpy(header.magic, PROTO_MAGIC, sizeof(header.magic));
+  memcpy(buf, &header, sizeof(header));
+}
+
+// Returns -1 (and leaves the frame untouched) if the entry doesn't fit.
+int proto_add(struct proto_builder *b, const uint16_t opcode, const uint16_t status, const void *data, const uint32_t len) {
+  if (b->failed || b->len + sizeof(struct proto_entry) + len > b->cap) return -1;
+
+  struct proto_header header;
+  memcpy(&header, b->buf, sizeof(header));
+  if (header.count == UINT16_MAX) return -1;
+  header.count++;
+  memcpy(b->buf, &header, sizeof(header));
+
+  const struct proto_entry entry = { .opcode = opcode, .status = status, .length = len };
+  memcpy(b->buf + b->len, &entry, sizeof(entry));
+  if (len > 0) memcpy(b->buf + b->len + sizeof(entry), data, len);
+  b->len += sizeof(entry) + len;
+  return 0;
+}
+
+size_t proto_finish(struct proto_builder *b) {
+  if (b->failed) return 0;
+  const uint32_t length = b->len - offsetof(struct proto_header, version);
+  memcpy(b->buf + offsetof(struct proto_header, length), &length, sizeof(length));
+  return b->len;
+}
+
+int proto_count(const struct proto_builder *b) {
+  struct proto_header header;
+  memcpy(&header, b->buf, sizeof(header));
+  return header.count;
+}
+
+size_t proto_space(const struct proto_builder *b) {
+  return b->failed ? 0 : b->cap - b->len;
+}
+
+int proto_parse(const char *frame, const size_t len, struct proto_message *msg) {
+  struct proto_header header;
+  if (len < sizeof(header)) return -1;
+  memcpy(&header, frame, sizeof(header));
+  if (memcmp(header.magic, PROTO_MAGIC, sizeof(header.magic)) != 0 || header.version != PROTO_VERSION) return -1;
+  if (header.length != len - offsetof(struct proto_header, version)) return -1;
+
+  msg->flags = header.flags;
+  msg->count = header.count;
+  msg->request_id = header.request_id;
+  msg->entries = frame + sizeof(header);
+  msg->len = len - sizeof(header);
+  return 0;
+}
+
+// Steps through the entries of a parsed frame; returns 0 at the end and -1 on a truncated entry.
+int proto_next(const struct proto_message *msg, size_t *off, struct proto_entry *entry, const char **data) {
+  if (*off == msg->len) return 0;
+  if (msg->len - *off < sizeof(struct proto_entry)) return -1;
+
+  memcpy(entry, msg->entries + *off, sizeof(struct proto_entry));
+  if (msg->len - *off - sizeof(struct proto_entry) < entry->length) return -1;
+
+  *data = msg->entries + *off + sizeof(struct proto_entry);
+  *off += sizeof(struct proto_entry) + entry->length;
+  return 1;
+}
+
+int proto_validate(const struct proto_message *msg) {
+  size_t off = 0;
+  struct proto_entry entry;
+  const char *data;
+  int rc, count = 0;
+  while ((rc = proto_next(msg, &off, &entry, &data)) > 0) count++;
+  return rc == 0 && count == msg->count ? 0 : -1;
+}
+
+const char *proto_status_name(const uint16_t status) {
+  switch (status) {
+    case PROTO_OK: return "ok";
+    case PROTO_ERR_UNKNOWN_OP: return "unknown opcode";
+    case PROTO_ERR_BAD_ARGS: return "bad arguments";
+    case PROTO_ERR_FAILED: return "failed";
+    case PROTO_ERR_OVERFLOW: return "response too large";
+    case PROTO_ERR_MALFORMED: return "malformed request";
+    default: return "unknown status";
+  }
+}
@@ -0,0 +1,99 @@
+//
+// Created by jay on 1/11/25.
+//
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Control protocol v2. Every frame starts like a v1 frame (4-byte magic + uint32 length of the rest), so the server
+// frames both the same way; v1 frames carry "K808" and free text, v2 frames carry "K8v2" and the header below. A frame
+// holds `count` entries (a batch), each an opcode with its arguments; the response frame echoes the request id and
+// holds one entry per request entry, in the same order, with the status filled in.
+#define PROTO_MAGIC "K8v2"
+#define PROTO_VERSION 2
+#define PROTO_MAX_FRAME 65536
+
+enum proto_opcode {
+  PROTO_OP_PING = 1,           // -> (nothing)
+  PROTO_OP_QUIT = 2,           // -> (nothing)
+  PROTO_OP_GET_STATE = 3,      // -> uint32 layer count, uint32 default layer, uint32 device count, uint32 layer per device
+  PROTO_OP_SWITCH_LAYER = 4,   // int32 device (-1 for all), uint32 layer
+  PROTO_OP_PUSH_LAYER = 5,     // uint32 layer
+  PROTO_OP_POP_LAYER = 6,      // (nothing)
+  PROTO_OP_REGISTER_REMAP = 7, // uint32 layer, uint32 key, uint16 codes... (pressed in order, released in reverse)
+  PROTO_OP_GET_STATS = 8,      // -> struct proto_handler_stats per handler
+  PROTO_OP_GET_METRICS = 9     // -> Prometheus text
+};
+
+// PROTO_ERR_OVERFLOW: the result didn't fit in the response frame. Only read-only entries can get it (everything with
+// side effects has an empty result), so retrying them in a smaller batch is always safe.
+// PROTO_ERR_MALFORMED: the request frame itself was broken (a truncated entry, or a count that doesn't match). Nothing
+// in it ran; the response holds just this one entry, with opcode 0.
+enum proto_status {
+  PROTO_OK = 0, PROTO_ERR_UNKNOWN_OP, PROTO_ERR_BAD_ARGS, PROTO_ERR_FAILED, PROTO_ERR_OVERFLOW, PROTO_ERR_MALFORMED
+};
+
+struct proto_header {
+  char magic[4];
+  uint32_t length; // bytes following this field
+  uint8_t version;
+  uint8_t flags;
+  uint16_t count;
+  uint32_t request_id;
+};
+
+struct proto_entry {
+  uint16_t opcode;
+  uint16_t status; // always PROTO_OK in requests
+  uint32_t length; // argument/result bytes following this entry
+};
+
+// layer and key are -1 for the layer-switch handler
+struct proto_handler_stats {
+  int32_t layer;
+  int32_t key;
+  uint64_t calls;
+  uint64_t skipped;
+  uint64_t overruns;
+  uint64_t wall_ns;
+  uint64_t wall_max_ns;
+  uint64_t cpu_samples;
+  uint64_t cpu_ns;
+  uint64_t cpu_max_ns;
+  uint32_t quarantined;
+  uint32_t reserved;
+};
+
+struct proto_builder {
+  char *buf;
+  size_t cap;
+  size_t len;
+  int failed;
+};
+
+struct proto_message {
+  uint8_t flags;
+  uint16_t count;
+  uint32_t request_id;
+  const char *entries;
+  size_t len;
+};
+
+void proto_begin(struct proto_builder *b, char *buf, size_t cap, uint32_t request_id);
+int proto_add(struct proto_builder *b, uint16_t opcode, uint16_t status, const void *data, uint32_t len);
+size_t proto_finish(struct proto_builder *b);
+int proto_count(const struct proto_builder *b);
+// Bytes still free in the frame, for an entry and its result.
+size_t proto_space(const struct proto_builder *b);
+
+int proto_parse(const char *frame, size_t len, struct proto_message *msg);
+int proto_next(const struct proto_message *msg, size_t *off, struct proto_entry *entry, const char **data);
+// Walks every entry; returns 0 if they're all intact and there are exactly as many as the header says, -1 otherwise.
+int proto_validate(const struct proto_message *msg);
+
+const char *proto_status_name(uint16_t status);
+
+#endif //PROTOCOL_H
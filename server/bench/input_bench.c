@@ -0,0 +1,130 @@
+//
+// Created by jay on 1/12/25.
+//
+
+#include "../input.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define BENCH_FRAMES 1000000
+#define BENCH_BURST 16 // frames per write, like a held key on several pads or a fast knob turn
+#define QUEUE_SIZE 64  // what libevdev buffers per read
+
+static volatile uint64_t decoded = 0;
+static FILE *devnull;
+
+struct writer_args {
+  int fd;
+  const struct input_event *events;
+  int count;
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *writer(void *_args) {
+  const struct writer_args *args = _args;
+  const int burst = BENCH_BURST * 3;
+  for (int i = 0; i < args->count; i += burst) {
+    const int n = args->count - i < burst ? args->count - i : burst;
+    if (write(args->fd, args->events + i, n * sizeof(struct input_event)) < 0) break;
+  }
+  close(args->fd);
+  return NULL;
+}
+
+// A key press or release as the K808 reports it: scan code, key, SYN_REPORT.
+static struct input_event *generate(const int frames) {
+  static const uint16_t codes[] = { 79, 80, 81, 75, 76, 77, 71, 72, 73, 82, 83, 96, 30, 48 };
+  struct input_event *res = calloc(frames * 3, sizeof(struct input_event));
+  srand(808);
+  for (int i = 0; i < frames; i++) {
+    const uint16_t code = codes[rand() % (sizeof(codes) / sizeof(codes[0]))];
+    res[3 * i] = (struct input_event){ .type = EV_MSC, .code = MSC_SCAN, .value = 0x70000 + code };
+    res[3 * i + 1] = (struct input_event){ .type = EV_KEY, .code = code, .value = i % 2 == 0 };
+    res[3 * i + 2] = (struct input_event){ .type = EV_SYN, .code = SYN_REPORT, .value = 0 };
+  }
+  return res;
+}
+
+// The previous read path: events come out of a small queue one call at a time (as with libevdev_next_event), each is
+// logged and decoded on its own.
+struct queue {
+  int fd;
+  struct input_event events[QUEUE_SIZE];
+  int head;
+  int tail;
+};
+
+static __attribute__((noinline)) int next_event(struct queue *q, struct input_event *ev) {
+  if (q->head == q->tail) {
+    const ssize_t rd = read(q->fd, q->events, sizeof(q->events));
+    if (rd <= 0) return -1;
+    q->head = 0;
+    q->tail = rd / sizeof(struct input_event);
+  }
+  *ev = q->events[q->head++];
+  return 0;
+}
+
+static void per_event(const int fd) {
+  struct queue q = { .fd = fd, .head = 0, .tail = 0 };
+  struct input_event ev;
+  while (next_event(&q, &ev) == 0) {
+    fprintf(devnull, "[Thread %02d]: (%ld) Received { type = %d; code = %d; value = %d }.\n",
+      0, ev.time.tv_usec, ev.type, ev.code, ev.value);
+    if (ev.type == EV_KEY && input_key_of(ev.code) >= 0) decoded++;
+  }
+}
+
+static void on_frame(const struct input_key *keys, const int count, void *) {
+  for (int i = 0; i < count; i++) decoded += keys[i].key >= 0;
+}
+
+static void bulk(const int fd) {
+  struct input_event events[INPUT_BATCH];
+  struct input_frame frame = { 0 };
+  ssize_t rd;
+  while ((rd = read(fd, events, sizeof(events))) > 0) {
+    input_decode(&frame, events, rd / sizeof(struct input_event), on_frame, NULL, NULL);
+  }
+}
+
+static void bench(const char *name, void (*reader)(int), const struct input_event *events, const int count) {
+  int fds[2];
+  if (pipe(fds) < 0) {
+    perror("pipe");
+    exit(EXIT_FAILURE);
+  }
+
+  struct writer_args args = { .fd = fds[1], .events = events, .count = count };
+  pthread_t thread;
+  decoded = 0;
+  const uint64_t start = now_ns();
+  pthread_create(&thread, NULL, writer, &args);
+  reader(fds[0]);
+  const uint64_t elapsed = now_ns() - start;
+  pthread_join(thread, NULL);
+  close(fds[0]);
+
+  printf("%-9s | %8d events | %8.2f ns/event | %6.2f M events/s | %lu keys\n",
+    name, count, (double)elapsed / count, count * 1e3 / elapsed, decoded);
+}
+
+int main(void) {
+  devnull = fopen("/dev/null", "w");
+  struct input_event *events = generate(BENCH_FRAMES);
+  bench("per-event", per_event, events, BENCH_FRAMES * 3);
+  bench("bulk", bulk, events, BENCH_FRAMES * 3);
+  free(events);
+  fclose(devnull);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,74 @@
+//
+// Created by jay on 1/4/25.
+//
+
+#include "../sequence.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_KEYS 10000000
+
+static volatile uint64_t fired = 0;
+static volatile uint64_t replayed = 0;
+
+static void on_sequence(const enum k808_key *, const int, void *) {
+  fired++;
+}
+
+static void on_replay(const enum k808_key, const enum k808_event, void *) {
+  replayed++;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench(const int sequences) {
+  struct sequence_table *table = init_sequence_table();
+  srand(808);
+  for (int i = 0; i < sequences; i++) {
+    enum k808_key keys[K808_MAX_SEQUENCE];
+    const int count = 2 + rand() % (K808_MAX_SEQUENCE - 1);
+    keys[0] = K808_ENTER;
+    for (int j = 1; j < count; j++) keys[j] = rand() % K808_KEY_COUNT;
+    sequence_table_add(table, keys, count, on_sequence, NULL);
+  }
+
+  const uint64_t compile_start = now_ns();
+  sequence_table_compile(table);
+  const uint64_t compile_ns = now_ns() - compile_start;
+
+  enum k808_key *input = malloc(BENCH_KEYS * sizeof(enum k808_key));
+  for (int i = 0; i < BENCH_KEYS; i++) {
+    // bias towards the leader so most presses walk the trie
+    input[i] = rand() % 4 == 0 ? K808_ENTER : rand() % K808_KEY_COUNT;
+  }
+
+  struct sequence_state state = { 0 };
+  fired = replayed = 0;
+  const uint64_t start = now_ns();
+  for (int i = 0; i < BENCH_KEYS; i++) {
+    sequence_feed(table, &state, input[i], K808_KEY_PRESS, 0, on_replay, NULL);
+    sequence_feed(table, &state, input[i], K808_KEY_RELEASE, 0, on_replay, NULL);
+  }
+  const uint64_t elapsed = now_ns() - start;
+
+  printf("%6d sequences | %7d states | compile %8.3f ms | %6.2f ns/key | %lu fired, %lu replayed\n",
+    sequences, sequence_table_node_count(table), (double)compile_ns / 1e6, (double)elapsed / BENCH_KEYS,
+    fired, replayed);
+
+  free(input);
+  free_sequence_table(table);
+}
+
+int main(void) {
+  const int sizes[] = { 1, 10, 100, 1000, 5000, 20000 };
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    bench(sizes[i]);
+  }
+  return EXIT_SUCCESS;
+}
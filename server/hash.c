@@ -0,0 +1,15 @@
+//
+// Created by jay on 1/9/25.
+//
+
+#include "hash.h"
+
+// 32-bit FNV-1a; start from HASH_SEED and feed the previous result back in to hash several regions.
+uint32_t hash_bytes(uint32_t hash, const void *data, const size_t len) {
+  const uint8_t *bytes = data;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
@@ -0,0 +1,15 @@
+//
+// Created by jay on 1/9/25.
+//
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_SEED 2166136261u
+
+uint32_t hash_bytes(uint32_t hash, const void *data, size_t len);
+
+#endif //HASH_H
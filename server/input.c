@@ -0,0 +1,65 @@
+//
+// Created by jay on 1/12/25.
+//
+
+#include "input.h"
+
+#include <stddef.h>
+
+#define DECODE_CODES 128
+
+// The keypad sends either the keypad codes or letter codes; entries hold the key + 1, so 0 means "not a keypad key".
+static const uint8_t decode_table[DECODE_CODES] = {
+  [KEY_KP1] = K808_1 + 1, [KEY_A] = K808_1 + 1,
+  [KEY_KP2] = K808_2 + 1, [KEY_B] = K808_2 + 1,
+  [KEY_KP3] = K808_3 + 1, [KEY_C] = K808_3 + 1,
+  [KEY_KP4] = K808_4 + 1, [KEY_D] = K808_4 + 1,
+  [KEY_KP5] = K808_5 + 1, [KEY_E] = K808_5 + 1,
+  [KEY_KP6] = K808_6 + 1, [KEY_F] = K808_6 + 1,
+  [KEY_KP7] = K808_7 + 1, [KEY_J] = K808_7 + 1,
+  [KEY_KP8] = K808_8 + 1, [KEY_L] = K808_8 + 1,
+  [KEY_KP9] = K808_9 + 1, [KEY_M] = K808_9 + 1,
+  [KEY_KP0] = K808_0 + 1, [KEY_K] = K808_0 + 1,
+  [KEY_KPDOT] = K808_DOT + 1,
+  [KEY_KPENTER] = K808_ENTER + 1,
+};
+
+int input_key_of(const uint16_t code) {
+  return code < DECODE_CODES ? decode_table[code] - 1 : -1;
+}
+
+static void flush(struct input_frame *frame, const input_frame_handler handler, void *user_data) {
+  if (frame->count > 0) handler(frame->keys, frame->count, user_data);
+  frame->count = 0;
+}
+
+int input_decode(struct input_frame *frame, const struct input_event *events, const int count,
+                 const input_frame_handler handler, const input_resync_handler resync, void *user_data) {
+  int frames = 0;
+  for (int i = 0; i < count; i++) {
+    const struct input_event *ev = events + i;
+
+    if (ev->type == EV_SYN) {
+      if (ev->code == SYN_DROPPED) {
+        frame->count = 0;
+        frame->dropping = 1;
+      }
+      else if (ev->code == SYN_REPORT) {
+        if (!frame->dropping) {
+          flush(frame, handler, user_data);
+          frames++;
+        }
+        else {
+          frame->dropping = 0;
+          if (resync != NULL) resync(user_data);
+        }
+      }
+      continue;
+    }
+    if (ev->type != EV_KEY || frame->dropping) continue;
+
+    if (frame->count == INPUT_BATCH) flush(frame, handler, user_data);
+    frame->keys[frame->count++] = (struct input_key){ .key = input_key_of(ev->code), .code = ev->code, .value = ev->value };
+  }
+  return frames;
+}
@@ -0,0 +1,41 @@
+//
+// Created by jay on 1/12/25.
+//
+
+#ifndef INPUT_H
+#define INPUT_H
+
+#include "k808_context.h"
+
+#include <stdint.h>
+#include <linux/input.h>
+
+// Events read from a device with a single read(); also the most keys a frame can hold before it's flushed early.
+#define INPUT_BATCH 64
+
+// A key event from the device; key is -1 if the code isn't one of the keypad's.
+struct input_key {
+  int16_t key;
+  uint16_t code;
+  int32_t value;
+};
+
+// Decoded keys of the frame that's still open, kept between reads.
+struct input_frame {
+  int count;
+  int dropping;
+  struct input_key keys[INPUT_BATCH];
+};
+
+typedef void (*input_frame_handler)(const struct input_key *keys, int count, void *user_data);
+// Called once the events lost to a buffer overflow have been skipped; the device state must be queried again.
+typedef void (*input_resync_handler)(void *user_data);
+
+int input_key_of(uint16_t code);
+// Decodes a batch of raw events and hands every completed frame (terminated by SYN_REPORT) to the handler; events
+// after a SYN_DROPPED are discarded up to and including the next SYN_REPORT, after which resync (if any) is called.
+// Returns the number of frames handled.
+int input_decode(struct input_frame *frame, const struct input_event *events, int count, input_frame_handler handler,
+                 input_resync_handler resync, void *user_data);
+
+#endif //INPUT_H
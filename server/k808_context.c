@@ -5,6 +5,12 @@
 #include "k808_context.h"
 #include "vector.h"
 #include "mutex.h"
+#include "sequence.h"
+#include "trace.h"
+#include "output.h"
+#include "snapshot.h"
+#include "input.h"
+#include "metrics.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,52 +18,144 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <time.h>
 #include <libevdev/libevdev.h>
 #include <linux/uinput.h>
 #include <pthread.h>
 #include <signal.h>
+#include <poll.h>
+#include <dirent.h>
+
+// How long a device thread sleeps without input before checking for sequence timeouts and shutdown.
+#define POLL_INTERVAL_MS 10
+#define CPU_SAMPLE_PERIOD 16
+#define READ_RETRIES 8 // consecutive failed reads before a device is dropped
+#define READ_BACKOFF_MAX_MS 1000
+#define CONTROL_THREAD_ID (-2) // lock owner for threads that aren't device threads (-1 means unlocked)
+#define QUARANTINE_STRIKES 3 // overruns in a row (on one device) before a handler is quarantined
+#define STATS_SHARDS 64 // split like the metrics: shard 0 for threads that aren't device threads, device n on 1 + n % 63
 
 // TODO: use mutexes
 
+// One cache line of a handler's stats; every device thread counts into its own, so running the same handler on many
+// devices never bounces a line between them. Shards are only summed when the stats are read.
+struct stats_shard {
+  _Alignas(64) uint64_t calls;
+  uint64_t skipped;
+  uint64_t overruns;
+  uint64_t wall_ns;
+  uint64_t wall_max_ns;
+  uint64_t cpu_samples;
+  uint64_t cpu_ns;
+  uint64_t cpu_max_ns;
+  uint64_t streak; // overruns since the last call that stayed within the budget
+};
+
+// Only the quarantine flag is shared; device threads just read it, until it's set.
+struct handler_stats {
+  struct stats_shard shards[STATS_SHARDS];
+  int quarantined;
+};
+
 struct key_event_handler {
   k808_handler h;
   void *user_data;
+  struct handler_stats stats;
 };
 
+// Handlers are immutable once registered; re-registering swaps in a new one so device threads never see a handler
+// paired with another handler's user data. Replaced handlers are kept until the layer is freed, as a device thread
+// may still be running them.
 struct k808_layer {
   char *name;
-  struct key_event_handler handlers[K808_KEY_COUNT];
+  struct key_event_handler *handlers[K808_KEY_COUNT];
+  struct vector *retired;
+};
+
+// Press and release output of a key, compiled once at registration and written as-is.
+struct key_reports {
+  const struct k808 *k808;
+  struct output_report *reports[2]; // indexed by enum k808_event
+};
+
+// Layer stack of a device or device group, padded to whole cache lines so neighbouring states never share one.
+struct layer_state {
+  _Alignas(64) int stack[K808_MAX_LAYER_DEPTH];
+  int depth;
+  int current;
+};
+
+struct profile {
+  char *match;
+  int layer;
+  int group;
 };
 
 struct local_ctx {
+  struct device_ctx *dev;
   int raw_fd;
   struct libevdev *device;
+  struct input_event events[INPUT_BATCH];
+  struct input_frame frame;
 };
 
-struct thread_data {
-  int thread_id;
+// Per-device state; only the owning thread writes here (unless the device joined a group).
+struct device_ctx {
+  _Alignas(64) int thread_id;
   struct k808 *k808;
   char *raw_path;
+  struct layer_state *layers;
+  int group;
+  int restored;
+  uint32_t pressed;
+  struct key_event_handler *held[K808_KEY_COUNT]; // handler that took each held key's press; gets its repeats and release
+  int held_layer[K808_KEY_COUNT];
+  uint64_t overflows;
+  int persist_pending; // set when another thread changed this device's layers; its state slot is stale
+  struct sequence_state sequence;
+  struct layer_state own;
+
+  // handler in progress, for the watchdog
+  struct key_event_handler *running;
+  uint64_t running_since;
+  int running_layer;
+  int running_key;
+  uint64_t flagged_since; // only touched by the watchdog
 };
 
 struct k808 {
   pthread_t *threads;
-  struct thread_data *args;
+  struct device_ctx *devices;
   int thread_count;
 
   struct vector *layers;
-  int layer_idx;
+  struct layer_state *defaults;
+  struct vector *groups;
+  struct vector *profiles;
   k808_layer_change on_switch;
   void *on_switch_data;
+  struct handler_stats switch_stats;
+  struct sequence_table *sequences;
 
   FILE *logger;
   struct mutex *layers_lock;
   struct mutex *output_lock;
 
-  int output_fd;
+  struct output *output;
+  struct vector *reports;
+  char *state_path;
+  struct snapshot *snapshot;
+
+  uint64_t budget_ns;
+  int quarantine;
+  pthread_t watchdog;
+  int has_watchdog;
   volatile int exiting;
 };
 
+static _Thread_local struct device_ctx *current_device = NULL;
+
 static void k808_log(FILE *fd, const char *fmt, ...) {
   va_list args;
   va_start(args, fmt);
@@ -65,22 +163,92 @@ static void k808_log(FILE *fd, const char *fmt, ...) {
   va_end(args);
 }
 
+static void free_indirect(void *d) {
+  free(*(void **)d);
+}
+
 void free_layer(void *layer) {
-  struct k808_layer *l = layer;
+  const struct k808_layer *l = layer;
   free(l->name);
-  free(l);
+  for (int i = 0; i < K808_KEY_COUNT; i++) free(l->handlers[i]);
+  free_vector(l->retired, free_indirect);
+}
+
+static void free_key_reports(void *r) {
+  struct key_reports *reports = *(struct key_reports **)r;
+  free_output_report(reports->reports[K808_KEY_PRESS]);
+  free_output_report(reports->reports[K808_KEY_RELEASE]);
+  free(reports);
+}
+
+static void free_profile(void *p) {
+  const struct profile *profile = p;
+  free(profile->match);
+}
+
+static void init_layer_state(struct layer_state *state, const int layer) {
+  state->stack[0] = layer;
+  state->depth = 1;
+  state->current = layer;
+}
+
+static struct layer_state *new_layer_state(const int layer) {
+  struct layer_state *res = aligned_alloc(_Alignof(struct layer_state), sizeof(struct layer_state));
+  init_layer_state(res, layer);
+  return res;
+}
+
+// Only accepts stacks that refer to existing layers; returns 0 if the state was restored.
+static int layer_state_restore(const struct k808 *k808, struct layer_state *state, const int *stack, const int depth) {
+  if (depth < 1 || depth > K808_MAX_LAYER_DEPTH) return -1;
+  for (int i = 0; i < depth; i++) {
+    if (k808_nth_layer(k808, stack[i]) == NULL) return -1;
+  }
+
+  memcpy(state->stack, stack, depth * sizeof(int));
+  state->depth = depth;
+  state->current = stack[depth - 1];
+  return 0;
+}
+
+static int layer_state_current(const struct layer_state *state) {
+  return __atomic_load_n(&state->current, __ATOMIC_RELAXED);
+}
+
+static int layer_state_set(struct layer_state *state, const int layer) {
+  state->stack[state->depth - 1] = layer;
+  __atomic_store_n(&state->current, layer, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static int layer_state_push(struct layer_state *state, const int layer) {
+  if (state->depth == K808_MAX_LAYER_DEPTH) return -1;
+  state->stack[state->depth++] = layer;
+  __atomic_store_n(&state->current, layer, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static int layer_state_pop(struct layer_state *state, const int) {
+  if (state->depth <= 1) return -1;
+  state->depth--;
+  __atomic_store_n(&state->current, state->stack[state->depth - 1], __ATOMIC_RELAXED);
+  return 0;
 }
 
 struct k808 *init_k808(void) {
-  struct k808 *res = malloc(sizeof(struct k808));
+  struct k808 *res = aligned_alloc(_Alignof(struct k808), sizeof(struct k808));
   res->threads = NULL;
-  res->args = NULL;
+  res->devices = NULL;
   res->thread_count = 0;
 
   res->layers = init_vector(sizeof(struct k808_layer));
-  res->layer_idx = 0;
+  res->defaults = new_layer_state(0);
+  res->groups = init_vector(sizeof(struct layer_state *));
+  res->profiles = init_vector(sizeof(struct profile));
   res->on_switch = NULL;
   res->on_switch_data = NULL;
+  memset(&res->switch_stats, 0, sizeof(res->switch_stats));
+  res->sequences = init_sequence_table();
 
   res->logger = stderr; // TODO: replace by /var/log/k808.log
   if (res->logger == NULL) {
@@ -91,38 +259,13 @@ struct k808 *init_k808(void) {
   res->layers_lock = new_mutex();
   res->output_lock = new_mutex();
 
-  res->output_fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
-  if (res->output_fd < 0) {
-    k808_log(res->logger, "[K808 ERROR]: Can't open /dev/uinput: %s\n", strerror(errno));
-    fclose(res->logger);
-    free_vector(res->layers, free_layer);
-    return NULL;
-  }
-
-  struct uinput_setup setup = {
-    .id = {
-      .bustype = BUS_USB,
-      .vendor = K808_REMAPPED_VENDOR,
-      .product = K808_REMAPPED_PRODUCT
-    },
-    .name = "K808 [REMAP]"
-  };
-  ioctl(res->output_fd, UI_SET_EVBIT, EV_KEY);
-  for (int i = 0; i < 256; i++) {
-    ioctl(res->output_fd, UI_SET_KEYBIT, i);
-  }
-
-  if (ioctl(res->output_fd, UI_DEV_SETUP, &setup) < 0 || ioctl(res->output_fd, UI_DEV_CREATE) < 0) {
-    k808_log(res->logger, "[K808 ERROR]: Can't create uinput device: %s\n", strerror(errno));
-    fclose(res->logger);
-    free_vector(res->layers, free_layer);
-    close(res->output_fd);
-    return 0;
-  }
-
-  k808_log(res->logger, "[K808 INFO]: Opened /dev/uinput as fd %d.\n", res->output_fd);
-  k808_log(res->logger, "[K808 INFO]: Created uinput device at %x:%x as %s.\n", setup.id.vendor, setup.id.product, setup.name);
-
+  res->output = init_output(res->logger);
+  res->reports = init_vector(sizeof(struct key_reports *));
+  res->state_path = NULL;
+  res->snapshot = NULL;
+  res->budget_ns = 0;
+  res->quarantine = 0;
+  res->has_watchdog = 0;
   res->exiting = 0;
 
   return res;
@@ -132,11 +275,12 @@ struct k808_layer *k808_add_layer(const struct k808 *k808, const char *layer_nam
   struct k808_layer *layer = malloc(sizeof(struct k808_layer));
   layer->name = strdup(layer_name);
   for (int i = 0; i < K808_KEY_COUNT; i++) {
-    layer->handlers[i].h = NULL;
-    layer->handlers[i].user_data = NULL;
+    layer->handlers[i] = NULL;
   }
+  layer->retired = init_vector(sizeof(struct key_event_handler *));
 
   push_back(k808->layers, layer);
+  free(layer);
   return vector_last(k808->layers);
 }
 
@@ -153,7 +297,7 @@ struct k808_layer *k808_current_layer(const struct k808 *k808) {
 }
 
 int k808_current_layer_idx(const struct k808 *k808) {
-  return k808->layer_idx;
+  return layer_state_current(current_device != NULL ? current_device->layers : k808->defaults);
 }
 
 void k808_register_handler(struct k808_layer *layer, const enum k808_key key, const k808_handler handler, void *user_data) {
@@ -161,62 +305,560 @@ void k808_register_handler(struct k808_layer *layer, const enum k808_key key, co
     return;
   }
 
-  layer->handlers[key].h = handler;
-  layer->handlers[key].user_data = user_data;
+  struct key_event_handler *next = NULL;
+  if (handler != NULL) {
+    next = aligned_alloc(_Alignof(struct key_event_handler), sizeof(struct key_event_handler));
+    next->h = handler;
+    next->user_data = user_data;
+    memset(&next->stats, 0, sizeof(next->stats));
+  }
+
+  struct key_event_handler *old = __atomic_exchange_n(&layer->handlers[key], next, __ATOMIC_ACQ_REL);
+  if (old != NULL) push_back(layer->retired, &old);
+}
+
+static void report_handler(const enum k808_key, const enum k808_event event, void *user_data) {
+  const struct key_reports *reports = user_data;
+  const struct output_report *report = reports->reports[event];
+  if (report == NULL) return;
+
+  K808_TRACE(send_keys_submit, output_report_size(report));
+  const int rc = output_emit(reports->k808->output, report);
+  K808_TRACE(send_keys_complete, output_report_size(report), rc);
+}
+
+static struct output_report *compile_report(const struct k808 *k808, const struct key_event *keys, const int count) {
+  if (count == 0) return NULL;
+
+  struct input_event *events = malloc(count * sizeof(struct input_event));
+  for (int i = 0; i < count; i++) {
+    events[i] = (struct input_event){ .type = EV_KEY, .code = keys[i].key, .value = keys[i].is_key_press };
+  }
+  struct output_report *res = output_compile(k808->output, events, count);
+  free(events);
+  return res;
+}
+
+int k808_register_report(const struct k808 *k808, const int layer, const enum k808_key key, const struct key_event *press,
+                         const int press_count, const struct key_event *release, const int release_count) {
+  struct k808_layer *l = k808_nth_layer(k808, layer);
+  if (l == NULL || key < 0 || key >= K808_KEY_COUNT || press_count < 0 || release_count < 0) return -1;
+
+  // uinput capabilities are fixed once the output devices exist
+  for (int i = 0; k808->thread_count > 0 && i < press_count + release_count; i++) {
+    const uint16_t code = i < press_count ? press[i].key : release[i - press_count].key;
+    if (!output_supports(k808->output, EV_KEY, code)) return -1;
+  }
+  for (int i = 0; i < press_count; i++) output_require(k808->output, EV_KEY, press[i].key);
+  for (int i = 0; i < release_count; i++) output_require(k808->output, EV_KEY, release[i].key);
+
+  struct key_reports *reports = malloc(sizeof(struct key_reports));
+  reports->k808 = k808;
+  reports->reports[K808_KEY_PRESS] = compile_report(k808, press, press_count);
+  reports->reports[K808_KEY_RELEASE] = compile_report(k808, release, release_count);
+  push_back(k808->reports, &reports);
+
+  k808_register_handler(l, key, report_handler, reports);
+  return 0;
+}
+
+int k808_register_remap(const struct k808 *k808, const int layer, const enum k808_key key, const uint16_t *codes, const int count) {
+  if (count <= 0 || count > K808_MAX_REMAP) return -1;
+
+  struct key_event press[K808_MAX_REMAP], release[K808_MAX_REMAP];
+  for (int i = 0; i < count; i++) {
+    press[i] = (struct key_event){ .key = codes[i], .is_key_press = 1 };
+    release[i] = (struct key_event){ .key = codes[count - 1 - i], .is_key_press = 0 };
+  }
+  return k808_register_report(k808, layer, key, press, count, release, count);
 }
 
 void k808_register_layer_switch_handler(struct k808 *k808, const k808_layer_change handler, void *user_data) {
   k808->on_switch = handler;
   k808->on_switch_data = user_data;
+  memset(&k808->switch_stats, 0, sizeof(k808->switch_stats));
 }
 
-static void handle_key(const struct k808 *k808, const int thread_id, const int ev_key, const int ev_value) {
-  const struct k808_layer *curr = vector_at(k808->layers, k808->layer_idx);
-  if (curr == NULL) return;
+static uint64_t clock_ns(const clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-  const enum k808_event event = ev_value ? K808_KEY_PRESS : K808_KEY_RELEASE;
-  enum k808_key key;
-  switch (ev_key) {
-    case 79: case 30: key = K808_1; break;
-    case 80: case 48: key = K808_2; break;
-    case 81: case 46: key = K808_3; break;
-    case 75: case 32: key = K808_4; break;
-    case 76: case 18: key = K808_5; break;
-    case 77: case 33: key = K808_6; break;
-    case 71: case 36: key = K808_7; break;
-    case 72: case 38: key = K808_8; break;
-    case 73: case 50: key = K808_9; break;
-    case 82: case 37: key = K808_0; break;
-    case 83: key = K808_DOT; break;
-    case 96: key = K808_ENTER; break;
-
-    default:
-      k808_log(k808->logger, "[Thread %02d]: Unknown key code %d.\n", thread_id, ev_key);
+static void update_max(uint64_t *max, const uint64_t value) {
+  uint64_t curr = __atomic_load_n(max, __ATOMIC_RELAXED);
+  while (value > curr && !__atomic_compare_exchange_n(max, &curr, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+// The calling thread's shard; it's still updated atomically, as devices past the last shard (and the threads that
+// aren't device threads) share one.
+static struct stats_shard *own_shard(struct handler_stats *stats) {
+  return stats->shards + (current_device != NULL ? 1 + current_device->thread_id % (STATS_SHARDS - 1) : 0);
+}
+
+// Returns 1 (and counts the skip) if the handler was quarantined.
+static int stats_skip(struct handler_stats *stats) {
+  if (!__atomic_load_n(&stats->quarantined, __ATOMIC_RELAXED)) return 0;
+  __atomic_fetch_add(&own_shard(stats)->skipped, 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+// Reading the thread CPU clock is a syscall (the monotonic clock comes from the vDSO), so only every
+// CPU_SAMPLE_PERIOD-th handler call on a thread is measured. Returns 0 if this call isn't sampled.
+static uint64_t cpu_sample(void) {
+  static _Thread_local unsigned calls = 0;
+  return calls++ % CPU_SAMPLE_PERIOD == 0 ? clock_ns(CLOCK_THREAD_CPUTIME_ID) : 0;
+}
+
+// Returns 1 if the call ran over the budget; cpu_start is what cpu_sample returned before the call.
+static int stats_account(const struct k808 *k808, struct handler_stats *stats, const uint64_t wall,
+                         const uint64_t cpu_start) {
+  struct stats_shard *shard = own_shard(stats);
+  if (cpu_start != 0) {
+    const uint64_t cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+    __atomic_fetch_add(&shard->cpu_samples, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&shard->cpu_ns, cpu, __ATOMIC_RELAXED);
+    update_max(&shard->cpu_max_ns, cpu);
+  }
+  __atomic_fetch_add(&shard->calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&shard->wall_ns, wall, __ATOMIC_RELAXED);
+  update_max(&shard->wall_max_ns, wall);
+
+  if (k808->budget_ns == 0 || wall <= k808->budget_ns) {
+    if (__atomic_load_n(&shard->streak, __ATOMIC_RELAXED) != 0) __atomic_store_n(&shard->streak, 0, __ATOMIC_RELAXED);
+    return 0;
+  }
+  __atomic_fetch_add(&shard->overruns, 1, __ATOMIC_RELAXED);
+  // a single overrun can come from preemption or a blocked log; only a handler that keeps overrunning is quarantined
+  if (__atomic_add_fetch(&shard->streak, 1, __ATOMIC_RELAXED) >= QUARANTINE_STRIKES && k808->quarantine) {
+    __atomic_store_n(&stats->quarantined, 1, __ATOMIC_RELAXED);
+  }
+  return 1;
+}
+
+static uint64_t max_u64(const uint64_t a, const uint64_t b) {
+  return a > b ? a : b;
+}
+
+static void stats_copy(struct k808_handler_stats *out, const struct handler_stats *stats, const int layer, const int key) {
+  memset(out, 0, sizeof(*out));
+  out->layer = layer;
+  out->key = key;
+  for (int i = 0; i < STATS_SHARDS; i++) {
+    const struct stats_shard *shard = stats->shards + i;
+    out->calls += __atomic_load_n(&shard->calls, __ATOMIC_RELAXED);
+    out->skipped += __atomic_load_n(&shard->skipped, __ATOMIC_RELAXED);
+    out->overruns += __atomic_load_n(&shard->overruns, __ATOMIC_RELAXED);
+    out->wall_ns += __atomic_load_n(&shard->wall_ns, __ATOMIC_RELAXED);
+    out->wall_max_ns = max_u64(out->wall_max_ns, __atomic_load_n(&shard->wall_max_ns, __ATOMIC_RELAXED));
+    out->cpu_samples += __atomic_load_n(&shard->cpu_samples, __ATOMIC_RELAXED);
+    out->cpu_ns += __atomic_load_n(&shard->cpu_ns, __ATOMIC_RELAXED);
+    out->cpu_max_ns = max_u64(out->cpu_max_ns, __atomic_load_n(&shard->cpu_max_ns, __ATOMIC_RELAXED));
+  }
+  out->quarantined = __atomic_load_n(&stats->quarantined, __ATOMIC_RELAXED);
+}
+
+void k808_set_handler_budget(struct k808 *k808, const int budget_ms, const int quarantine) {
+  if (k808->thread_count > 0) {
+    k808_log(k808->logger, "[K808 ERROR]: The handler budget must be set before the driver is started.\n");
+    return;
+  }
+  k808->budget_ns = budget_ms > 0 ? (uint64_t)budget_ms * 1000000 : 0;
+  k808->quarantine = quarantine;
+}
+
+int k808_handler_stats(const struct k808 *k808, struct k808_handler_stats *out, const int cap) {
+  int count = 0;
+  for (int i = 0; i < vector_size(k808->layers); i++) {
+    const struct k808_layer *layer = vector_at(k808->layers, i);
+    for (int k = 0; k < K808_KEY_COUNT; k++) {
+      const struct key_event_handler *handler = __atomic_load_n(&layer->handlers[k], __ATOMIC_ACQUIRE);
+      if (handler == NULL) continue;
+      if (count < cap) stats_copy(out + count, &handler->stats, i, k);
+      count++;
+    }
+  }
+
+  if (k808->on_switch != NULL) {
+    if (count < cap) stats_copy(out + count, &k808->switch_stats, -1, -1);
+    count++;
+  }
+  return count;
+}
+
+typedef int (*layer_op)(struct layer_state *state, int layer);
+
+// Device threads change their own state (or their group's), the control thread changes all of them, so stacks are
+// only changed (and written to the snapshot) under layers_lock; current stays atomic so dispatch reads it lock-free.
+static int layers_lock_owner(void) {
+  return current_device != NULL ? current_device->thread_id : CONTROL_THREAD_ID;
+}
+
+static void lock_layers(const struct k808 *k808) {
+  mutex_acquire_sync(k808->layers_lock, layers_lock_owner());
+}
+
+static void unlock_layers(const struct k808 *k808) {
+  mutex_release(k808->layers_lock, layers_lock_owner());
+}
+
+static void persist_device(const struct k808 *k808, const struct device_ctx *dev) {
+  if (k808->snapshot == NULL) return;
+  snapshot_store_device(k808->snapshot, dev->thread_id, dev->group, dev->layers->stack, dev->layers->depth);
+}
+
+// A device's state slot is only written by the device's own thread; others ask it to rewrite the slot.
+static void request_persist(struct device_ctx *dev) {
+  if (current_device == dev) persist_device(dev->k808, dev);
+  else __atomic_store_n(&dev->persist_pending, 1, __ATOMIC_RELEASE);
+}
+
+static void persist_pending(struct device_ctx *dev) {
+  if (!__atomic_exchange_n(&dev->persist_pending, 0, __ATOMIC_ACQUIRE)) return;
+  lock_layers(dev->k808);
+  persist_device(dev->k808, dev);
+  unlock_layers(dev->k808);
+}
+
+static void persist_defaults(const struct k808 *k808) {
+  if (k808->snapshot == NULL) return;
+  snapshot_store_defaults(k808->snapshot, k808->defaults->stack, k808->defaults->depth);
+}
+
+static void notify_switch(const struct k808 *k808, const int thread_id, const int old_idx, const int new_idx) {
+  if (old_idx == new_idx) return;
+  K808_TRACE(layer_switch, thread_id, old_idx, new_idx);
+  if (k808->on_switch == NULL) return;
+
+  // the stats are only ever updated atomically, so they stay writable through the const context
+  struct handler_stats *stats = (struct handler_stats *)&k808->switch_stats;
+  if (stats_skip(stats)) return;
+
+  const uint64_t wall = clock_ns(CLOCK_MONOTONIC);
+  const uint64_t cpu = cpu_sample();
+  k808->on_switch(k808_nth_layer(k808, old_idx), k808_nth_layer(k808, new_idx), k808->on_switch_data);
+  const uint64_t wall_ns = clock_ns(CLOCK_MONOTONIC) - wall;
+  if (stats_account(k808, stats, wall_ns, cpu)) {
+    k808_log(k808->logger, "[K808 WARN]: Layer switch handler took %.3f ms%s.\n", wall_ns / 1e6,
+      __atomic_load_n(&stats->quarantined, __ATOMIC_RELAXED) ? ", quarantined" : "");
+  }
+}
+
+// On a device thread, layer operations only affect that device (or its group); anywhere else they affect the defaults
+// and every device. The switch handler is called after the lock is released, so it may change layers itself.
+static int apply_layer_op(const struct k808 *k808, const layer_op op, const int n) {
+  if (op != layer_state_pop && k808_nth_layer(k808, n) == NULL) return -1;
+
+  if (current_device != NULL) {
+    lock_layers(k808);
+    const int old_idx = layer_state_current(current_device->layers);
+    const int res = op(current_device->layers, n);
+    if (res == 0) persist_device(k808, current_device);
+    const int new_idx = layer_state_current(current_device->layers);
+    unlock_layers(k808);
+
+    if (res < 0) return -1;
+    notify_switch(k808, current_device->thread_id, old_idx, new_idx);
+    return 0;
+  }
+
+  lock_layers(k808);
+  const int old_idx = layer_state_current(k808->defaults);
+  if (op(k808->defaults, n) < 0) {
+    unlock_layers(k808);
+    return -1;
+  }
+  for (int i = 0; i < k808->thread_count; i++) {
+    if (k808->devices[i].layers == &k808->devices[i].own) op(&k808->devices[i].own, n);
+  }
+  for (int i = 0; i < vector_size(k808->groups); i++) {
+    op(*(struct layer_state **)vector_at(k808->groups, i), n);
+  }
+  persist_defaults(k808);
+  for (int i = 0; i < k808->thread_count; i++) request_persist(k808->devices + i);
+  const int new_idx = layer_state_current(k808->defaults);
+  unlock_layers(k808);
+
+  notify_switch(k808, -1, old_idx, new_idx);
+  return 0;
+}
+
+int k808_switch_layer(const struct k808 *k808, const int n) {
+  return apply_layer_op(k808, layer_state_set, n);
+}
+
+int k808_push_layer(const struct k808 *k808, const int n) {
+  return apply_layer_op(k808, layer_state_push, n);
+}
+
+int k808_pop_layer(const struct k808 *k808) {
+  return apply_layer_op(k808, layer_state_pop, 0);
+}
+
+int k808_device_count(const struct k808 *k808) {
+  return k808->thread_count;
+}
+
+int64_t k808_device_overflows(const struct k808 *k808, const int device) {
+  if (device < 0 || device >= k808->thread_count) return -1;
+  return __atomic_load_n(&k808->devices[device].overflows, __ATOMIC_RELAXED);
+}
+
+int k808_device_layer_idx(const struct k808 *k808, const int device) {
+  if (device < 0 || device >= k808->thread_count) return -1;
+  return layer_state_current(k808->devices[device].layers);
+}
+
+int k808_switch_device_layer(const struct k808 *k808, const int device, const int n) {
+  if (device < 0 || device >= k808->thread_count || k808_nth_layer(k808, n) == NULL) return -1;
+
+  lock_layers(k808);
+  struct layer_state *state = k808->devices[device].layers;
+  const int old_idx = layer_state_current(state);
+  layer_state_set(state, n);
+  request_persist(k808->devices + device);
+  unlock_layers(k808);
+
+  notify_switch(k808, device, old_idx, n);
+  return 0;
+}
+
+int k808_add_group(const struct k808 *k808, const int layer) {
+  struct layer_state *state = new_layer_state(k808_nth_layer(k808, layer) == NULL ? 0 : layer);
+  lock_layers(k808);
+  push_back(k808->groups, &state);
+  const int res = vector_size(k808->groups) - 1;
+  unlock_layers(k808);
+  return res;
+}
+
+void k808_add_profile(const struct k808 *k808, const char *match, const int layer, const int group) {
+  const struct profile profile = { .match = strdup(match), .layer = layer, .group = group };
+  push_back(k808->profiles, &profile);
+}
+
+void k808_set_state_file(struct k808 *k808, const char *path) {
+  free(k808->state_path);
+  k808->state_path = path == NULL ? NULL : strdup(path);
+}
+
+int k808_register_sequence(const struct k808 *k808, const enum k808_key *keys, const int count, const k808_sequence_handler handler, void *user_data) {
+  if (k808->thread_count > 0) {
+    k808_log(k808->logger, "[K808 ERROR]: Sequences must be registered before the driver is started.\n");
+    return -1;
+  }
+
+  return sequence_table_add(k808->sequences, keys, count, handler, user_data);
+}
+
+void k808_set_sequence_timeout(const struct k808 *k808, const int timeout_ms) {
+  sequence_table_set_timeout(k808->sequences, timeout_ms);
+}
+
+void k808_require_output(const struct k808 *k808, const uint16_t type, const uint16_t code) {
+  output_require(k808->output, type, code);
+}
+
+static uint64_t now_ms(void) {
+  return clock_ns(CLOCK_MONOTONIC) / 1000000;
+}
+
+static void dispatch_key(const enum k808_key key, const enum k808_event event, void *_dev) {
+  struct device_ctx *dev = _dev;
+  // repeats and the release go to whatever took the press, even if the layer (or its handler) changed since; they're
+  // never skipped either, so a quarantine or a layer switch can't leave a key held on the output side
+  struct key_event_handler *handler = dev->held[key];
+  int layer_idx = dev->held_layer[key];
+  if (handler == NULL) {
+    layer_idx = layer_state_current(dev->layers);
+    const struct k808_layer *curr = vector_at(dev->k808->layers, layer_idx);
+    if (curr == NULL) return;
+
+    handler = __atomic_load_n(&curr->handlers[key], __ATOMIC_ACQUIRE);
+    if (handler == NULL) {
+      metrics_add(METRIC_HANDLER_MISSES, 1);
+      k808_log(dev->k808->logger, "[Thread %02d]: No handler for key %d.\n", dev->thread_id, key);
       return;
+    }
+    if (stats_skip(&handler->stats)) return;
+    if (event == K808_KEY_PRESS) {
+      dev->held[key] = handler;
+      dev->held_layer[key] = layer_idx;
+    }
   }
+  else if (event == K808_KEY_RELEASE) dev->held[key] = NULL;
+
+  const uint64_t wall = clock_ns(CLOCK_MONOTONIC);
+  const uint64_t cpu = cpu_sample();
+  dev->running_layer = layer_idx;
+  dev->running_key = key;
+  __atomic_store_n(&dev->running_since, wall, __ATOMIC_RELAXED);
+  __atomic_store_n(&dev->running, handler, __ATOMIC_RELEASE);
+
+  K808_TRACE(handler_enter, dev->thread_id, layer_idx, key, event);
+  handler->h(key, event, handler->user_data);
+  K808_TRACE(handler_return, dev->thread_id, layer_idx, key, event);
+
+  __atomic_store_n(&dev->running, NULL, __ATOMIC_RELEASE);
+  const uint64_t wall_ns = clock_ns(CLOCK_MONOTONIC) - wall;
+  if (stats_account(dev->k808, &handler->stats, wall_ns, cpu)) {
+    k808_log(dev->k808->logger, "[Thread %02d]: Handler for key %d on layer %d took %.3f ms%s.\n",
+      dev->thread_id, key, layer_idx, wall_ns / 1e6,
+      __atomic_load_n(&handler->stats.quarantined, __ATOMIC_RELAXED) ? ", quarantined" : "");
+  }
+}
+
+// Flags handlers that are still running past the budget, so a stuck handler is reported (and quarantined) while it's
+// stuck rather than once it returns.
+static void *watchdog_driver(void *_k808) {
+  const struct k808 *k808 = _k808;
+  uint64_t period = k808->budget_ns / 4;
+  if (period < 1000000) period = 1000000;
+  if (period > 100000000) period = 100000000;
+  const struct timespec ts = { .tv_sec = period / 1000000000, .tv_nsec = period % 1000000000 };
+
+  while (!k808->exiting) {
+    nanosleep(&ts, NULL);
+    const uint64_t now = clock_ns(CLOCK_MONOTONIC);
+    for (int i = 0; i < k808->thread_count; i++) {
+      struct device_ctx *dev = k808->devices + i;
+      struct key_event_handler *handler = __atomic_load_n(&dev->running, __ATOMIC_ACQUIRE);
+      const uint64_t since = __atomic_load_n(&dev->running_since, __ATOMIC_RELAXED);
+      if (handler == NULL || now < since + k808->budget_ns) continue;
+
+      // a stall as long as QUARANTINE_STRIKES overruns in a row counts as that many
+      if (k808->quarantine && now >= since + QUARANTINE_STRIKES * k808->budget_ns &&
+          !__atomic_exchange_n(&handler->stats.quarantined, 1, __ATOMIC_RELAXED)) {
+        k808_log(k808->logger, "[K808 WARN]: Handler for key %d on layer %d quarantined, still running after %.3f ms.\n",
+          dev->running_key, dev->running_layer, (now - since) / 1e6);
+      }
+      if (since == dev->flagged_since) continue;
+
+      dev->flagged_since = since;
+      K808_TRACE(handler_stall, dev->thread_id, dev->running_layer, dev->running_key, (now - since) / 1000);
+      k808_log(k808->logger, "[K808 WARN]: Handler for key %d on layer %d has been running for %.3f ms on thread %02d.\n",
+        dev->running_key, dev->running_layer, (now - since) / 1e6, dev->thread_id);
+    }
+  }
+  return NULL;
+}
 
-  if (curr->handlers[key].h == NULL) {
-    k808_log(k808->logger, "[Thread %02d]: No handler for key %d.\n", thread_id, key);
+static void handle_key(const struct k808 *k808, struct device_ctx *dev, const struct input_key *in) {
+  const int thread_id = dev->thread_id;
+  K808_TRACE(key_decode, thread_id, in->code, in->key, in->value);
+  if (in->key < 0) {
+    metrics_add(METRIC_UNKNOWN_CODES, 1);
+    k808_log(k808->logger, "[Thread %02d]: Unknown key code %d.\n", thread_id, in->code);
     return;
   }
 
-  curr->handlers[key].h(key, event, curr->handlers[key].user_data);
+  const enum k808_key key = in->key;
+  const int ev_value = in->value;
+  const enum k808_event event = ev_value ? K808_KEY_PRESS : K808_KEY_RELEASE;
+
+  // a resync already applied the kernel's key state, which includes events still queued behind the overflow; those
+  // show up as a second press of a held key, or a release (or repeat) of a released one, and are dropped here
+  const int was_pressed = (dev->pressed >> key) & 1;
+  if (ev_value == 1 ? was_pressed : !was_pressed) return;
+
+  if (event == K808_KEY_PRESS) dev->pressed |= 1u << key;
+  else dev->pressed &= ~(1u << key);
+
+  // auto-repeat of a key that's part of a pending (or just matched) sequence is meaningless
+  if (ev_value == 2 && sequence_owns(&dev->sequence, key)) return;
+  if (sequence_feed(k808->sequences, &dev->sequence, key, event, now_ms(), dispatch_key, dev)) return;
+
+  dispatch_key(key, event, dev);
+}
+
+static void handle_frame(const struct input_key *keys, const int count, void *_local) {
+  struct device_ctx *dev = ((struct local_ctx *)_local)->dev;
+  for (int i = 0; i < count; i++) handle_key(dev->k808, dev, keys + i);
+}
+
+// After an overflow, the kernel's key state is the truth: keys we still think are down get released and keys that went
+// down during the gap get pressed, so nothing stays stuck on the output side.
+static void resync_keys(void *_local) {
+  const struct local_ctx *local = _local;
+  struct device_ctx *dev = local->dev;
+  const uint64_t overflows = __atomic_add_fetch(&dev->overflows, 1, __ATOMIC_RELAXED);
+  metrics_add(METRIC_INPUT_OVERFLOWS, 1);
+
+  uint8_t bits[KEY_MAX / 8 + 1] = { 0 };
+  if (ioctl(local->raw_fd, EVIOCGKEY(sizeof(bits)), bits) < 0) {
+    k808_log(dev->k808->logger, "[Thread %02d]: Input overflow #%lu, can't query key state: %s\n",
+      dev->thread_id, overflows, strerror(errno));
+    return;
+  }
+
+  uint32_t actual = 0;
+  uint16_t codes[K808_KEY_COUNT] = { 0 };
+  for (int code = 0; code <= KEY_MAX; code++) {
+    const int key = input_key_of(code);
+    if (key < 0 || !(bits[code / 8] & 1 << code % 8)) continue;
+    actual |= 1u << key;
+    codes[key] = code;
+  }
+
+  const uint32_t changed = actual ^ dev->pressed;
+  K808_TRACE(input_overflow, dev->thread_id, overflows, __builtin_popcount(changed));
+  k808_log(dev->k808->logger, "[Thread %02d]: Input overflow #%lu, resyncing %d keys.\n",
+    dev->thread_id, overflows, __builtin_popcount(changed));
+
+  for (int key = 0; key < K808_KEY_COUNT; key++) {
+    if (!(changed & 1u << key)) continue;
+    const struct input_key in = { .key = key, .code = codes[key], .value = (actual >> key) & 1 };
+    handle_key(dev->k808, dev, &in);
+  }
+}
+
+// Profiles match on a substring of the device node, its physical path or its serial; the first match wins. Devices that
+// were restored from the state file keep their restored assignment.
+static void select_profile(struct device_ctx *dev, const struct libevdev *device) {
+  const struct k808 *k808 = dev->k808;
+  if (dev->restored) return;
+
+  const char *phys = libevdev_get_phys(device);
+  const char *uniq = libevdev_get_uniq(device);
+
+  lock_layers(k808);
+  for (int i = 0; i < vector_size(k808->profiles); i++) {
+    const struct profile *p = vector_at(k808->profiles, i);
+    if (strstr(dev->raw_path, p->match) == NULL && (phys == NULL || strstr(phys, p->match) == NULL) &&
+        (uniq == NULL || strstr(uniq, p->match) == NULL)) continue;
+
+    if (p->group >= 0 && p->group < vector_size(k808->groups)) {
+      dev->layers = *(struct layer_state **)vector_at(k808->groups, p->group);
+      dev->group = p->group;
+      k808_log(k808->logger, "[Thread %02d]: Profile '%s' matched, joining group %d.\n", dev->thread_id, p->match, p->group);
+    }
+    else if (k808_nth_layer(k808, p->layer) != NULL) {
+      layer_state_set(&dev->own, p->layer);
+      k808_log(k808->logger, "[Thread %02d]: Profile '%s' matched, starting on layer %d.\n", dev->thread_id, p->match, p->layer);
+    }
+    persist_device(k808, dev);
+    break;
+  }
+  unlock_layers(k808);
 }
 
 // ReSharper disable once CppParameterMayBeConstPtrOrRef // pthread_create requires non-const void *
 // ReSharper disable once CppDFAConstantFunctionResult // duh, we have no useful return value
 static void *thread_driver(void *_args) {
   // arguments
-  const struct thread_data *args = _args;
-  const int thread_id = args->thread_id;
-  const struct k808 *k808 = args->k808;
-  const char *raw_path = args->raw_path;
-  struct local_ctx local = { 0 };
+  struct device_ctx *dev = _args;
+  const int thread_id = dev->thread_id;
+  const struct k808 *k808 = dev->k808;
+  const char *raw_path = dev->raw_path;
+  struct local_ctx local = { .dev = dev };
+  current_device = dev;
+  metrics_bind_device(thread_id);
 
   // setup
   local.raw_fd = open(raw_path, O_RDONLY | O_NONBLOCK);
   if (local.raw_fd < 0) {
     k808_log(k808->logger, "[Thread %02d]: Can't open %s: %s\n", thread_id, raw_path, strerror(errno));
+    if (!k808->exiting) metrics_add(METRIC_THREAD_EXITS, 1);
     return NULL;
   }
   k808_log(k808->logger, "[Thread %02d]: Opened input device at %s as fd %d.\n", thread_id, raw_path, local.raw_fd);
@@ -226,6 +868,7 @@ static void *thread_driver(void *_args) {
     k808_log(k808->logger, "[Thread %02d]: Can't create libevdev from %s (fd %d): %s\n", thread_id, raw_path, local.raw_fd, strerror(errno));
     libevdev_free(local.device);
     close(local.raw_fd);
+    if (!k808->exiting) metrics_add(METRIC_THREAD_EXITS, 1);
     return NULL;
   }
 
@@ -234,32 +877,50 @@ static void *thread_driver(void *_args) {
   }
 
   k808_log(k808->logger, "[Thread %02d]: Initialized libevdev for input device %s.\n", thread_id, libevdev_get_name(local.device));
+  select_profile(dev, local.device);
+  metrics_add(METRIC_DEVICE_THREADS, 1);
 
-  // event loop
-  struct input_event ev;
+  // event loop: libevdev is only used for setup; events are read in bulk and decoded a batch at a time
+  struct pollfd pfd = { .fd = local.raw_fd, .events = POLLIN };
+  int failures = 0;
   while (!k808->exiting) {
-    const int rc = libevdev_next_event(local.device, LIBEVDEV_READ_FLAG_NORMAL, &ev);
-    if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
-      k808_log(k808->logger, "[Thread %02d]: (%ld) Received { type = %d (%s); code = %d (%s); value = %d }.\n",
-        thread_id, ev.time.tv_usec,
-        ev.type, libevdev_event_type_get_name(ev.code),
-        ev.code, libevdev_event_code_get_name(ev.type, ev.code),
-        ev.value
-      );
-
-      if (ev.type == EV_KEY) handle_key(k808, thread_id, ev.code, ev.value);
-      else if (ev.type == EV_REL) {
-        // TODO
+    if (poll(&pfd, 1, POLL_INTERVAL_MS) > 0) {
+      const ssize_t rd = read(local.raw_fd, local.events, sizeof(local.events));
+      if (rd == 0 || (rd < 0 && errno == ENODEV)) {
+        k808_log(k808->logger, "[Thread %02d]: Input device %s is gone.\n", thread_id, raw_path);
+        break;
       }
+      // anything else may be transient, so it's retried with an exponential backoff before the device is dropped
+      if (rd < 0 && errno != EAGAIN && errno != EINTR) {
+        if (++failures > READ_RETRIES) {
+          k808_log(k808->logger, "[Thread %02d]: Failed to read events %d times in a row, dropping %s: %s\n",
+            thread_id, READ_RETRIES, raw_path, strerror(errno));
+          break;
+        }
+        const int delay_ms = POLL_INTERVAL_MS << (failures - 1) < READ_BACKOFF_MAX_MS
+          ? POLL_INTERVAL_MS << (failures - 1) : READ_BACKOFF_MAX_MS;
+        k808_log(k808->logger, "[Thread %02d]: Failed to read events (retrying in %d ms): %s\n",
+          thread_id, delay_ms, strerror(errno));
+        const struct timespec backoff = { .tv_sec = delay_ms / 1000, .tv_nsec = delay_ms % 1000 * 1000000L };
+        nanosleep(&backoff, NULL);
+      }
+      else if (rd > 0) failures = 0;
+
+      const int count = rd > 0 ? rd / (ssize_t)sizeof(struct input_event) : 0;
+      metrics_add(METRIC_EVENTS_READ, count);
+      for (int i = 0; i < count; i++) {
+        K808_TRACE(device_read, thread_id, local.events[i].type, local.events[i].code, local.events[i].value);
+      }
+      input_decode(&local.frame, local.events, count, handle_frame, resync_keys, &local);
     }
-    else if (rc != -EAGAIN) {
-      k808_log(k808->logger, "[Thread %02d]: Failed to read event: %s\n", thread_id, strerror(-rc));
-      break;
-    }
+    sequence_poll(k808->sequences, &dev->sequence, now_ms(), dispatch_key, dev);
+    persist_pending(dev);
   }
 
   // cleanup
   k808_log(k808->logger, "[Thread %02d]: Cleaning up.\n", thread_id);
+  metrics_add(METRIC_DEVICE_THREADS, -1);
+  if (!k808->exiting) metrics_add(METRIC_THREAD_EXITS, 1);
   libevdev_free(local.device);
   close(local.raw_fd);
   return NULL;
@@ -292,8 +953,110 @@ static struct vector *possible_devices(FILE *logger) {
   return res;
 }
 
-static void free_indirect(void *d) {
-  free(*(void **)d);
+// A cached device node is only trusted while sysfs still reports a K808 behind it.
+static int is_k808(const char *path) {
+  static char uevent[4096];
+  const char *node = strrchr(path, '/');
+  if (node == NULL) return 0;
+
+  char sys_path[256];
+  snprintf(sys_path, sizeof(sys_path), "/sys/class/input%s/device/uevent", node);
+  FILE *fp = fopen(sys_path, "r");
+  if (fp == NULL) return 0;
+  const size_t len = fread(uevent, 1, sizeof(uevent) - 1, fp);
+  fclose(fp);
+  uevent[len] = '\0';
+
+  return strstr(uevent, K808_VENDOR_ID) != NULL && strstr(uevent, K808_PRODUCT_ID) != NULL;
+}
+
+// Number of event nodes sysfs currently reports a K808 behind; cheaper than probing, but doesn't give the node order.
+static int count_k808_nodes(void) {
+  DIR *dir = opendir("/sys/class/input");
+  if (dir == NULL) return -1;
+
+  int res = 0;
+  const struct dirent *entry;
+  char path[300];
+  while ((entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, "event", 5) != 0) continue;
+    snprintf(path, sizeof(path), "/dev/input/%s", entry->d_name);
+    res += is_k808(path);
+  }
+  closedir(dir);
+  return res;
+}
+
+// The cached devices (in their cached order, which the state slots refer to) are only reused while they're exactly the
+// K808s that are plugged in now; a device that's gone or newly plugged makes the caller probe again.
+static struct vector *cached_devices(const struct k808 *k808) {
+  const int count = snapshot_device_count(k808->snapshot);
+  if (count == 0) return NULL;
+  const int present = count_k808_nodes();
+  if (present != count) {
+    k808_log(k808->logger, "[K808 INFO]: %d cached devices, but %d present, probing again.\n", count, present);
+    return NULL;
+  }
+
+  struct vector *res = init_vector(sizeof(const char *));
+  for (int i = 0; i < count; i++) {
+    const char *path = snapshot_device_path(k808->snapshot, i);
+    if (!is_k808(path)) {
+      k808_log(k808->logger, "[K808 INFO]: Cached device %s is gone, probing again.\n", path);
+      free_vector(res, free_indirect);
+      return NULL;
+    }
+
+    char *data = strdup(path);
+    push_back(res, &data);
+    k808_log(k808->logger, "[K808 INFO]: Reusing device #%d at %s.\n", vector_size(res), data);
+  }
+  return res;
+}
+
+// Imports the compiled sequences from the state file if they were built from the same registrations.
+static int load_sequences(const struct k808 *k808) {
+  uint32_t fingerprint;
+  size_t len;
+  const void *tables = snapshot_tables(k808->snapshot, &fingerprint, &len);
+  if (tables == NULL || fingerprint != sequence_table_fingerprint(k808->sequences)) return -1;
+  return sequence_table_import(k808->sequences, tables, len);
+}
+
+static void restore_device(const struct k808 *k808, struct device_ctx *dev) {
+  int stack[K808_MAX_LAYER_DEPTH];
+  int group = -1;
+  const int depth = snapshot_find_device(k808->snapshot, dev->raw_path, &group, stack);
+  if (depth == 0) return;
+
+  if (group >= 0 && group < vector_size(k808->groups)) {
+    struct layer_state *state = *(struct layer_state **)vector_at(k808->groups, group);
+    const int group_depth = snapshot_find_group(k808->snapshot, group, stack);
+    if (layer_state_restore(k808, state, stack, group_depth) < 0) return;
+    dev->layers = state;
+    dev->group = group;
+  }
+  else if (layer_state_restore(k808, &dev->own, stack, depth) < 0) return;
+
+  dev->restored = 1;
+  k808_log(k808->logger, "[K808 INFO]: Restored device %s on layer %d.\n", dev->raw_path, layer_state_current(dev->layers));
+}
+
+static void commit_snapshot(const struct k808 *k808) {
+  const char **paths = malloc(k808->thread_count * sizeof(const char *));
+  for (int i = 0; i < k808->thread_count; i++) paths[i] = k808->devices[i].raw_path;
+
+  const size_t len = sequence_table_export(k808->sequences, NULL, 0);
+  void *tables = malloc(len);
+  sequence_table_export(k808->sequences, tables, len);
+
+  if (snapshot_commit(k808->snapshot, paths, k808->thread_count, sequence_table_fingerprint(k808->sequences), tables, len) == 0) {
+    persist_defaults(k808);
+    for (int i = 0; i < k808->thread_count; i++) persist_device(k808, k808->devices + i);
+  }
+
+  free(tables);
+  free(paths);
 }
 
 enum k808_start_result k808_start_async(struct k808 *k808) {
@@ -307,7 +1070,38 @@ enum k808_start_result k808_start_async(struct k808 *k808) {
     return K808_NO_LAYERS;
   }
 
-  struct vector *devices = possible_devices(k808->logger);
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (output_create(k808->output) < 0) {
+    k808_log(k808->logger, "[K808 ERROR]: Failed to create output devices.\n");
+    return K808_NO_OUTPUT;
+  }
+
+  if (k808->state_path != NULL) {
+    k808->snapshot = snapshot_open(k808->state_path, k808->logger);
+  }
+  if (snapshot_valid(k808->snapshot)) {
+    int stack[K808_MAX_LAYER_DEPTH];
+    const int depth = snapshot_defaults(k808->snapshot, stack);
+    layer_state_restore(k808, k808->defaults, stack, depth);
+  }
+
+  if (load_sequences(k808) == 0) {
+    k808_log(k808->logger, "[K808 INFO]: Reusing %d compiled key sequence states from the state file.\n",
+      sequence_table_node_count(k808->sequences));
+  }
+  else if (sequence_table_compile(k808->sequences) < 0) {
+    k808_log(k808->logger, "[K808 ERROR]: Failed to compile key sequences.\n");
+    return K808_BAD_SEQUENCES;
+  }
+  else if (sequence_table_size(k808->sequences) > 0) {
+    k808_log(k808->logger, "[K808 INFO]: Compiled %d key sequences into %d states.\n",
+      sequence_table_size(k808->sequences), sequence_table_node_count(k808->sequences));
+  }
+
+  struct vector *devices = cached_devices(k808);
+  if (devices == NULL) devices = possible_devices(k808->logger);
   if (vector_size(devices) == 0) {
     k808_log(k808->logger, "No devices matching %s:%s found.", K808_VENDOR_ID, K808_PRODUCT_ID);
     return K808_NO_DEVICES;
@@ -315,17 +1109,36 @@ enum k808_start_result k808_start_async(struct k808 *k808) {
 
   k808->thread_count = vector_size(devices);
   k808->threads = malloc(k808->thread_count * sizeof(pthread_t));
-  k808->args = malloc(k808->thread_count * sizeof(struct thread_data));
+  k808->devices = aligned_alloc(_Alignof(struct device_ctx), k808->thread_count * sizeof(struct device_ctx));
+  memset(k808->devices, 0, k808->thread_count * sizeof(struct device_ctx));
+
+  for (int i = 0; i < k808->thread_count; i++) {
+    struct device_ctx *dev = k808->devices + i;
+    dev->k808 = k808;
+    dev->thread_id = i;
+    dev->raw_path = strdup(*(char **)vector_at(devices, i));
+    init_layer_state(&dev->own, layer_state_current(k808->defaults));
+    dev->layers = &dev->own;
+    dev->group = -1;
+    if (snapshot_valid(k808->snapshot)) restore_device(k808, dev);
+  }
+  if (k808->snapshot != NULL) commit_snapshot(k808);
 
   for (int i = 0; i < k808->thread_count; i++) {
-    k808->args[i].k808 = k808;
-    k808->args[i].thread_id = i;
-    k808->args[i].raw_path = strdup(*(char **)vector_at(devices, i));
-    pthread_create(k808->threads + i, NULL, &thread_driver, k808->args + i);
+    pthread_create(k808->threads + i, NULL, &thread_driver, k808->devices + i);
   }
 
   free_vector(devices, free_indirect);
 
+  if (k808->budget_ns > 0) {
+    k808->has_watchdog = pthread_create(&k808->watchdog, NULL, &watchdog_driver, k808) == 0;
+  }
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  k808_log(k808->logger, "[K808 INFO]: Driver started in %.3f ms.\n",
+    (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+
   return K808_RUNNING;
 }
 
@@ -336,34 +1149,42 @@ void k808_stop_sync(struct k808 *k808) {
   for (int i = 0; i < k808->thread_count; i++) {
     pthread_join(k808->threads[i], NULL);
   }
+  if (k808->has_watchdog) pthread_join(k808->watchdog, NULL);
 }
 
 void k808_free(struct k808 *k808) {
+  for (int i = 0; i < k808->thread_count; i++) free(k808->devices[i].raw_path);
   free(k808->threads);
-  free(k808->args);
+  free(k808->devices);
   free_vector(k808->layers, free_layer);
+  free(k808->defaults);
+  free_vector(k808->groups, free_indirect);
+  free_vector(k808->profiles, free_profile);
+  free_vector(k808->reports, free_key_reports);
+  free_snapshot(k808->snapshot);
+  free(k808->state_path);
+  free_sequence_table(k808->sequences);
   if (k808->logger != stderr) fclose(k808->logger);
   free_mutex(k808->layers_lock);
   free_mutex(k808->output_lock);
-  close(k808->output_fd);
+  free_output(k808->output);
   free(k808);
 }
 
 void send_keys(const struct k808 *k808, const struct key_event *keys, const int count) {
+  K808_TRACE(send_keys_submit, count);
   k808_log(k808->logger, "Sending %d key events.\n", count);
-  struct input_event ev = {0};
-  ev.type = EV_KEY;
+  struct input_event local[OUTPUT_BATCH];
+  struct input_event *events = count <= OUTPUT_BATCH ? local : malloc(count * sizeof(struct input_event));
+  if (events == NULL) return;
 
   for (int i = 0; i < count; i++) {
-    ev.code = keys[i].key;
-    ev.value = keys[i].is_key_press;
-    k808_log(k808->logger, "Sending { type = %d; code = %d; value = %d }.\n", ev.type, ev.code, ev.value);
-    write(k808->output_fd, &ev, sizeof(ev));
-  }
-
-  ev.type = EV_SYN;
-  ev.code = SYN_REPORT;
-  ev.value = 0;
-  k808_log(k808->logger, "Sending { type = %d; code = %d; value = %d }.\n", ev.type, ev.code, ev.value);
-  write(k808->output_fd, &ev, sizeof(ev));
-}
\ No newline at end of file
+    events[i] = (struct input_event){ .type = EV_KEY, .code = keys[i].key, .value = keys[i].is_key_press };
+    k808_log(k808->logger, "Sending { type = %d; code = %d; value = %d }.\n", events[i].type, events[i].code, events[i].value);
+  }
+  // one frame for the whole request, so the combination stays atomic
+  const int rc = output_write(k808->output, events, count);
+  if (events != local) free(events);
+
+  K808_TRACE(send_keys_complete, count, rc);
+}
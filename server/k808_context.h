@@ -9,6 +9,9 @@
 #define K808_PRODUCT_ID "2350"
 #define K808_REMAPPED_VENDOR 0x3008
 #define K808_REMAPPED_PRODUCT 0x800E
+#define K808_MAX_SEQUENCE 8
+#define K808_MAX_LAYER_DEPTH 8
+#define K808_MAX_REMAP 8
 
 #include <stdint.h>
 
@@ -28,7 +31,8 @@ enum k808_event {
 };
 
 enum k808_start_result {
-  K808_RUNNING, K808_NO_CTX, K808_ALREADY_RUNNING, K808_NO_LAYERS, K808_NO_DEVICES
+  K808_RUNNING, K808_NO_CTX, K808_ALREADY_RUNNING, K808_NO_LAYERS, K808_NO_DEVICES, K808_NO_OUTPUT,
+  K808_BAD_SEQUENCES
 };
 
 struct key_event {
@@ -36,8 +40,25 @@ struct key_event {
   int is_key_press;
 };
 
+// Cost of one registered handler, as reported by k808_handler_stats; layer and key are -1 for the layer-switch handler.
+// CPU time is only measured on a sample of the calls (cpu_samples of them).
+struct k808_handler_stats {
+  int layer;
+  int key;
+  uint64_t calls;
+  uint64_t skipped;
+  uint64_t overruns;
+  uint64_t wall_ns;
+  uint64_t wall_max_ns;
+  uint64_t cpu_samples;
+  uint64_t cpu_ns;
+  uint64_t cpu_max_ns;
+  int quarantined;
+};
+
 typedef void (*k808_handler)(enum k808_key key, enum k808_event event, void *user_data);
 typedef void (*k808_layer_change)(const struct k808_layer *old, const struct k808_layer *new, void *user_data);
+typedef void (*k808_sequence_handler)(const enum k808_key *keys, int count, void *user_data);
 
 struct k808 *init_k808(void);
 struct k808_layer *k808_add_layer(const struct k808 *k808, const char *layer_name);
@@ -46,7 +67,34 @@ struct k808_layer *k808_nth_layer(const struct k808 *k808, int n);
 struct k808_layer *k808_current_layer(const struct k808 *k808);
 int k808_current_layer_idx(const struct k808 *k808);
 void k808_register_handler(struct k808_layer *layer, enum k808_key key, k808_handler handler, void *user_data);
+// Registers a handler that writes prebuilt press and release reports; either side may be empty.
+int k808_register_report(const struct k808 *k808, int layer, enum k808_key key, const struct key_event *press,
+                         int press_count, const struct key_event *release, int release_count);
+int k808_register_remap(const struct k808 *k808, int layer, enum k808_key key, const uint16_t *codes, int count);
 void k808_register_layer_switch_handler(struct k808 *k808, k808_layer_change handler, void *user_data);
+// Called from a handler, layer changes apply to the device that triggered it; anywhere else they apply to all devices.
+int k808_switch_layer(const struct k808 *k808, int n);
+int k808_push_layer(const struct k808 *k808, int n);
+int k808_pop_layer(const struct k808 *k808);
+int k808_device_count(const struct k808 *k808);
+int k808_device_layer_idx(const struct k808 *k808, int device);
+// Number of times the kernel's input buffer of the device overflowed (and its key state was resynced).
+int64_t k808_device_overflows(const struct k808 *k808, int device);
+int k808_switch_device_layer(const struct k808 *k808, int device, int n);
+int k808_add_group(const struct k808 *k808, int layer);
+void k808_add_profile(const struct k808 *k808, const char *match, int layer, int group);
+void k808_set_state_file(struct k808 *k808, const char *path);
+int k808_register_sequence(const struct k808 *k808, const enum k808_key *keys, int count, k808_sequence_handler handler, void *user_data);
+void k808_set_sequence_timeout(const struct k808 *k808, int timeout_ms);
+// Handlers running longer than budget_ms are reported; with quarantine set, a handler that overruns several calls in a
+// row (or stalls for as long) is skipped from then on, until it's registered again. A budget of 0 disables the
+// watchdog. Must be called before the driver is started.
+void k808_set_handler_budget(struct k808 *k808, int budget_ms, int quarantine);
+// Fills up to cap entries and returns the number of handlers.
+int k808_handler_stats(const struct k808 *k808, struct k808_handler_stats *out, int cap);
+// Codes of registered reports and remaps are declared automatically; only codes that handlers send themselves (with
+// send_keys) need this. Undeclared codes are dropped (and logged) when sent.
+void k808_require_output(const struct k808 *k808, uint16_t type, uint16_t code);
 enum k808_start_result k808_start_async(struct k808 *k808);
 void k808_stop_sync(struct k808 *k808);
 void k808_free(struct k808 *k808);
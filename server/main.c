@@ -6,75 +6,252 @@
 
 #include "server.h"
 #include "k808_context.h"
+#include "protocol.h"
+#include "metrics.h"
 #include "string.h"
 
 #ifndef K808_SERVER
 #error "K808_SERVER is not defined. Expected a file path."
 #endif
 
-static struct key_event press[2] = {
-  { .key = KEY_LEFTMETA, .is_key_press = 1 },
-  { .key = 0, .is_key_press = 1 }
-};
+#ifndef K808_STATE
+#error "K808_STATE is not defined. Expected a file path."
+#endif
 
-static struct key_event release[2] = {
-  { .key = 0, .is_key_press = 0 },
-{ .key = KEY_LEFTMETA, .is_key_press = 0 },
-};
+#define HANDLER_BUDGET_MS 50
+
+// Overruns are only reported unless quarantine is asked for; even then it takes several in a row, as a single one can
+// come from preemption or a blocked log.
+#ifdef K808_QUARANTINE
+#define HANDLER_QUARANTINE 1
+#else
+#define HANDLER_QUARANTINE 0
+#endif
+#define METRICS_INTERVAL_MS 15000
+#define MAX_HANDLERS 256
 
-const static uint16_t remap[K808_KEY_COUNT] = {
+static const uint16_t remap[K808_KEY_COUNT] = {
   KEY_0, KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7, KEY_8, KEY_9, KEY_KPDOT, KEY_KPENTER
 };
 
-#define K808_X_KEYS X(K808_0) X(K808_1) X(K808_2) X(K808_3) X(K808_4) X(K808_5) X(K808_6) X(K808_7) X(K808_8) X(K808_9) X(K808_DOT) X(K808_ENTER)
+static void reply(const struct server *srv, const char *text) {
+  static char buffer[SERVER_HEADER_SIZE + 16384] = { 'K', '8', '0', '8' };
+  uint32_t len = strlen(text);
+  if (len > sizeof(buffer) - SERVER_HEADER_SIZE) len = sizeof(buffer) - SERVER_HEADER_SIZE;
+  memcpy(buffer + 4, &len, sizeof(len));
+  memcpy(buffer + SERVER_HEADER_SIZE, text, len);
+  server_reply(srv, buffer, SERVER_HEADER_SIZE + len);
+}
+
+static void format_stats(const struct k808 *k808, char *out, const size_t cap) {
+  static struct k808_handler_stats stats[MAX_HANDLERS];
+  int count = k808_handler_stats(k808, stats, MAX_HANDLERS);
+  if (count > MAX_HANDLERS) count = MAX_HANDLERS;
 
-void on_key(const enum k808_key key, const enum k808_event event, void *user) {
-  const struct k808 *k808 = user;
-  const char *event_str = event == K808_KEY_PRESS ? "press" : "release";
-  const char *key_str = NULL;
-  switch (key) {
-#define X(k) case k: key_str = #k; break;
-    K808_X_KEYS
-#undef X
-    default: key_str = NULL;
+  size_t len = snprintf(out, cap, "%d handlers", count);
+  for (int i = 0; i < count && len < cap; i++) {
+    const struct k808_handler_stats *s = stats + i;
+    const uint64_t calls = s->calls > 0 ? s->calls : 1;
+    const uint64_t samples = s->cpu_samples > 0 ? s->cpu_samples : 1;
+    if (s->layer < 0) len += snprintf(out + len, cap - len, "\nlayer switch:");
+    else len += snprintf(out + len, cap - len, "\nlayer %d key %d:", s->layer, s->key);
+    if (len >= cap) break;
+    len += snprintf(out + len, cap - len,
+      " calls=%lu wall avg/max=%.1f/%.1f us cpu avg/max=%.1f/%.1f us overruns=%lu skipped=%lu%s",
+      s->calls, s->wall_ns / 1e3 / calls, s->wall_max_ns / 1e3, s->cpu_ns / 1e3 / samples, s->cpu_max_ns / 1e3,
+      s->overruns, s->skipped, s->quarantined ? " (quarantined)" : "");
+  }
+  for (int i = 0; i < k808_device_count(k808) && len < cap; i++) {
+    len += snprintf(out + len, cap - len, "\ndevice %d: overflows=%ld", i, k808_device_overflows(k808, i));
   }
+}
 
-  fprintf(stderr, "K808: trigger %s %s (%d)\n", event_str, key_str, key);
+static int read_u32(const char *data, const uint32_t len, const uint32_t idx, uint32_t *out) {
+  if (len < (idx + 1) * sizeof(uint32_t)) return 0;
+  memcpy(out, data + idx * sizeof(uint32_t), sizeof(uint32_t));
+  return 1;
+}
 
-  if (event == K808_KEY_PRESS) {
-    press[1].key = remap[key];
-    send_keys(k808, press, 2);
+// Executes one entry of a v2 batch and appends its result, which may take up to room bytes; returns 1 if the daemon
+// should stop afterwards.
+static int execute(struct k808 *k808, struct proto_builder *out, const struct proto_entry *entry, const char *data,
+                   const size_t room) {
+  static struct k808_handler_stats stats[MAX_HANDLERS];
+  static struct proto_handler_stats wire[MAX_HANDLERS];
+  uint32_t args[3];
+  uint32_t state[3 + 64];
+  uint16_t status = PROTO_OK;
+  const void *result = NULL;
+  uint32_t result_len = 0;
+  int quit = 0;
+
+  switch (entry->opcode) {
+    case PROTO_OP_PING:
+      break;
+    case PROTO_OP_QUIT:
+      fprintf(stderr, "[K808] Received quit request...\n");
+      quit = 1;
+      break;
+    case PROTO_OP_GET_STATE: {
+      const int devices = k808_device_count(k808) < 64 ? k808_device_count(k808) : 64;
+      state[0] = k808_layer_count(k808);
+      state[1] = k808_current_layer_idx(k808);
+      state[2] = devices;
+      for (int i = 0; i < devices; i++) state[3 + i] = k808_device_layer_idx(k808, i);
+      result = state;
+      result_len = (3 + devices) * sizeof(uint32_t);
+      break;
+    }
+    case PROTO_OP_SWITCH_LAYER:
+      if (!read_u32(data, entry->length, 0, &args[0]) || !read_u32(data, entry->length, 1, &args[1])) status = PROTO_ERR_BAD_ARGS;
+      else if ((int32_t)args[0] < 0) status = k808_switch_layer(k808, args[1]) == 0 ? PROTO_OK : PROTO_ERR_FAILED;
+      else status = k808_switch_device_layer(k808, args[0], args[1]) == 0 ? PROTO_OK : PROTO_ERR_FAILED;
+      break;
+    case PROTO_OP_PUSH_LAYER:
+      if (!read_u32(data, entry->length, 0, &args[0])) status = PROTO_ERR_BAD_ARGS;
+      else status = k808_push_layer(k808, args[0]) == 0 ? PROTO_OK : PROTO_ERR_FAILED;
+      break;
+    case PROTO_OP_POP_LAYER:
+      status = k808_pop_layer(k808) == 0 ? PROTO_OK : PROTO_ERR_FAILED;
+      break;
+    case PROTO_OP_REGISTER_REMAP: {
+      uint16_t codes[K808_MAX_REMAP];
+      const uint32_t count = entry->length < 2 * sizeof(uint32_t) ? 0 : (entry->length - 2 * sizeof(uint32_t)) / sizeof(uint16_t);
+      if (!read_u32(data, entry->length, 0, &args[0]) || !read_u32(data, entry->length, 1, &args[1]) ||
+          count == 0 || count > K808_MAX_REMAP || args[1] >= K808_KEY_COUNT) {
+        status = PROTO_ERR_BAD_ARGS;
+        break;
+      }
+      memcpy(codes, data + 2 * sizeof(uint32_t), count * sizeof(uint16_t));
+      status = k808_register_remap(k808, args[0], args[1], codes, count) == 0 ? PROTO_OK : PROTO_ERR_FAILED;
+      break;
+    }
+    case PROTO_OP_GET_STATS: {
+      int count = k808_handler_stats(k808, stats, MAX_HANDLERS);
+      if (count > MAX_HANDLERS) count = MAX_HANDLERS;
+      for (int i = 0; i < count; i++) {
+        wire[i] = (struct proto_handler_stats){
+          .layer = stats[i].layer, .key = stats[i].key, .calls = stats[i].calls, .skipped = stats[i].skipped,
+          .overruns = stats[i].overruns, .wall_ns = stats[i].wall_ns, .wall_max_ns = stats[i].wall_max_ns,
+          .cpu_samples = stats[i].cpu_samples, .cpu_ns = stats[i].cpu_ns, .cpu_max_ns = stats[i].cpu_max_ns,
+          .quarantined = stats[i].quarantined
+        };
+      }
+      result = wire;
+      result_len = count * sizeof(struct proto_handler_stats);
+      break;
+    }
+    case PROTO_OP_GET_METRICS: {
+      static char text[PROTO_MAX_FRAME / 2];
+      const size_t len = metrics_export(text, sizeof(text));
+      result = text;
+      result_len = len < sizeof(text) ? len : sizeof(text) - 1;
+      break;
+    }
+    default:
+      metrics_add(METRIC_REJECTED_MESSAGES, 1);
+      status = PROTO_ERR_UNKNOWN_OP;
   }
-  else {
-    release[0].key = remap[key];
-    send_keys(k808, release, 2);
+
+  // only read-only entries have results, so this never drops the outcome of an entry that changed something
+  if (result_len > room) {
+    status = PROTO_ERR_OVERFLOW;
+    result_len = 0;
+  }
+  if (proto_add(out, entry->opcode, status, result, result_len) < 0) {
+    fprintf(stderr, "Response full, dropped the result of opcode %u\n", entry->opcode);
+  }
+  return quit;
+}
+
+static enum server_response on_v2_message(struct server *srv, struct k808 *k808, const size_t len, const char *msg) {
+  static char out[PROTO_MAX_FRAME];
+  struct proto_message req;
+  if (proto_parse(msg, len, &req) < 0) {
+    fprintf(stderr, "Invalid v2 message (%lu bytes)\n", len);
+    metrics_add(METRIC_REJECTED_MESSAGES, 1);
+    return SERVER_CLOSE_CONN;
+  }
+
+  struct proto_builder resp;
+  proto_begin(&resp, out, sizeof(out), req.request_id);
+
+  // a batch only runs when all of it is intact, so a broken entry can't leave the ones before it half-applied
+  if (proto_validate(&req) < 0) {
+    fprintf(stderr, "Malformed v2 message (request %u), nothing executed\n", req.request_id);
+    metrics_add(METRIC_REJECTED_MESSAGES, 1);
+    proto_add(&resp, 0, PROTO_ERR_MALFORMED, NULL, 0);
+    server_reply(srv, out, proto_finish(&resp));
+    return SERVER_KEEP_ALIVE;
   }
+
+  size_t off = 0;
+  struct proto_entry entry;
+  const char *data;
+  int quit = 0;
+  while (proto_next(&req, &off, &entry, &data) > 0) {
+    // every entry left in the request takes at least an entry header there, and gets one in the response
+    const size_t reserved = ((req.len - off) / sizeof(struct proto_entry) + 1) * sizeof(struct proto_entry);
+    const size_t space = proto_space(&resp);
+    quit |= execute(k808, &resp, &entry, data, space > reserved ? space - reserved : 0);
+  }
+
+  server_reply(srv, out, proto_finish(&resp));
+  if (quit) server_stop(srv);
+  return SERVER_KEEP_ALIVE;
 }
 
-enum server_response on_server_message(struct server *srv, const size_t len, const char *msg, void *) {
+enum server_response on_server_message(struct server *srv, const size_t len, const char *msg, void *user) {
+  if (len >= 4 && memcmp(msg, PROTO_MAGIC, 4) == 0) {
+    return on_v2_message(srv, user, len, msg);
+  }
+
   if (len < 8) {
     fprintf(stderr, "Invalid message length: %lu (expected 8 or more)\n", len);
+    metrics_add(METRIC_REJECTED_MESSAGES, 1);
     return SERVER_CLOSE_CONN;
   }
 
   if (msg[0] != 'K' || msg[1] != '8' || msg[2] != '0' || msg[3] != '8') {
     fprintf(stderr, "Invalid message header: %c%c%c%c\n", msg[0], msg[1], msg[2], msg[3]);
+    metrics_add(METRIC_REJECTED_MESSAGES, 1);
     return SERVER_CLOSE_CONN;
   }
 
-  const uint32_t actual_len = *(uint32_t *)(msg + 4);
+  uint32_t actual_len;
+  memcpy(&actual_len, msg + 4, sizeof(actual_len));
   if (len != actual_len + 8) {
     fprintf(stderr, "Invalid lengths: expected %d, but got %lu\n", actual_len + 8, len);
+    metrics_add(METRIC_REJECTED_MESSAGES, 1);
+    return SERVER_CLOSE_CONN;
   }
 
-  fprintf(stderr, "Message: '%.*s'", actual_len, msg + 8);
+  fprintf(stderr, "Message: '%.*s'\n", actual_len, msg + 8);
 
-  if (actual_len >= 4 && strncmp(msg + 8, "quit", 4) == 0) {
+  if (actual_len == 4 && strncmp(msg + 8, "quit", 4) == 0) {
     fprintf(stderr, "[K808] Received quit request...\n");
+    reply(srv, "ok");
     server_stop(srv);
   }
+  else if (actual_len == 4 && strncmp(msg + 8, "ping", 4) == 0) {
+    reply(srv, "pong");
+  }
+  else if (actual_len == 7 && strncmp(msg + 8, "metrics", 7) == 0) {
+    static char text[16384];
+    metrics_export(text, sizeof(text));
+    reply(srv, text);
+  }
+  else if (actual_len == 5 && strncmp(msg + 8, "stats", 5) == 0) {
+    static char text[16384];
+    format_stats(user, text, sizeof(text));
+    reply(srv, text);
+  }
+  else {
+    metrics_add(METRIC_REJECTED_MESSAGES, 1);
+    reply(srv, "error: unknown command");
+  }
 
-  return SERVER_CLOSE_CONN;
+  return SERVER_KEEP_ALIVE;
 }
 
 static struct k808 *k808;
@@ -82,27 +259,35 @@ static struct server *srv;
 
 void signal_handler(int) {
   printf(" --- Exit signal received! --- \n");
+  // server_run returns once it notices, after which main tears everything down
   server_stop(srv);
-  server_free(srv);
-  k808_stop_sync(k808);
-  k808_free(k808);
 }
 
 int main(void) {
   k808 = init_k808();
-  struct k808_layer *layer = k808_add_layer(k808, "default");
-#define X(k) k808_register_handler(layer, k, on_key, k808);
-  K808_X_KEYS
-#undef X
+  k808_add_layer(k808, "default");
+  // Meta + key; compiled into prebuilt reports, so the handlers share no mutable state across device threads
+  for (int i = 0; i < K808_KEY_COUNT; i++) {
+    const uint16_t codes[] = { KEY_LEFTMETA, remap[i] };
+    k808_register_remap(k808, 0, i, codes, 2);
+  }
+  k808_set_state_file(k808, K808_STATE);
+  k808_set_handler_budget(k808, HANDLER_BUDGET_MS, HANDLER_QUARANTINE);
   if (k808_start_async(k808) != K808_RUNNING) return EXIT_FAILURE;
 
-  srv = init_server(K808_SERVER, on_server_message, NULL);
+  srv = init_server(K808_SERVER, on_server_message, k808);
+#ifdef K808_METRICS
+  struct metrics_dumper *dumper = init_metrics_dumper(K808_METRICS, METRICS_INTERVAL_MS);
+#endif
 
   signal(SIGINT, signal_handler);
   signal(SIGTERM, signal_handler);
 
   server_run(srv);
   server_free(srv);
+#ifdef K808_METRICS
+  free_metrics_dumper(dumper);
+#endif
 
   k808_stop_sync(k808);
   k808_free(k808);
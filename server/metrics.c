@@ -0,0 +1,140 @@
+//
+// Created by jay on 1/13/25.
+//
+
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define DUMP_BUFFER 16384
+
+struct shard {
+  _Alignas(64) int64_t values[METRIC_COUNT];
+};
+
+struct metrics_dumper {
+  char *path;
+  int interval_ms;
+  pthread_t thread;
+  volatile int exiting;
+};
+
+static const struct {
+  const char *name;
+  const char *help;
+  int gauge;
+  int per_device;
+} definitions[METRIC_COUNT] = {
+  [METRIC_EVENTS_READ] = { "k808_events_read_total", "Input events read from the keypads.", 0, 1 },
+  [METRIC_UNKNOWN_CODES] = { "k808_unknown_key_codes_total", "Key events with a code the keypad shouldn't send.", 0, 1 },
+  [METRIC_HANDLER_MISSES] = { "k808_handler_misses_total", "Keys pressed or released without a handler in the active layer.", 0, 1 },
+  [METRIC_INPUT_OVERFLOWS] = { "k808_input_overflows_total", "Kernel input buffer overflows (followed by a resync).", 0, 1 },
+  [METRIC_OUTPUT_FAILURES] = { "k808_output_write_failures_total", "Failed writes to the uinput devices.", 0, 0 },
+  [METRIC_REJECTED_MESSAGES] = { "k808_rejected_messages_total", "Malformed or unknown control socket messages.", 0, 0 },
+  [METRIC_THREAD_EXITS] = { "k808_device_thread_exits_total", "Device threads that stopped while the driver was running.", 0, 0 },
+  [METRIC_DEVICE_THREADS] = { "k808_device_threads", "Device threads currently reading input.", 1, 0 },
+  [METRIC_CONNECTIONS] = { "k808_control_connections", "Open control socket connections.", 1, 0 },
+};
+
+static struct shard shards[METRICS_SHARDS];
+static int device_shards = 0;
+static _Thread_local int current_shard = 0;
+
+// Devices beyond the last shard share shards; the totals stay right, only their per-device split doesn't.
+void metrics_bind_device(const int device) {
+  current_shard = 1 + device % (METRICS_SHARDS - 1);
+  int seen = __atomic_load_n(&device_shards, __ATOMIC_RELAXED);
+  while (current_shard > seen &&
+         !__atomic_compare_exchange_n(&device_shards, &seen, current_shard, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+// Shards are mostly written by a single thread, so the add never contends; it's atomic for shard 0 and the readers.
+void metrics_add(const enum metric metric, const int64_t delta) {
+  __atomic_fetch_add(&shards[current_shard].values[metric], delta, __ATOMIC_RELAXED);
+}
+
+static int64_t shard_value(const int shard, const enum metric metric) {
+  return __atomic_load_n(&shards[shard].values[metric], __ATOMIC_RELAXED);
+}
+
+int64_t metrics_get(const enum metric metric) {
+  int64_t res = 0;
+  for (int i = 0; i < METRICS_SHARDS; i++) res += shard_value(i, metric);
+  return res;
+}
+
+size_t metrics_export(char *buf, const size_t cap) {
+  size_t len = 0;
+#define APPEND(...) len += snprintf(buf + (len < cap ? len : cap), len < cap ? cap - len : 0, __VA_ARGS__)
+  const int devices = __atomic_load_n(&device_shards, __ATOMIC_RELAXED);
+  for (int m = 0; m < METRIC_COUNT; m++) {
+    APPEND("# HELP %s %s\n# TYPE %s %s\n", definitions[m].name, definitions[m].help, definitions[m].name,
+      definitions[m].gauge ? "gauge" : "counter");
+    if (!definitions[m].per_device) {
+      APPEND("%s %ld\n", definitions[m].name, metrics_get(m));
+      continue;
+    }
+    for (int d = 1; d <= devices; d++) {
+      APPEND("%s{device=\"%d\"} %ld\n", definitions[m].name, d - 1, shard_value(d, m));
+    }
+  }
+#undef APPEND
+  return len;
+}
+
+int metrics_dump(const char *path) {
+  static char text[DUMP_BUFFER];
+  const size_t len = metrics_export(text, sizeof(text));
+
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE *fp = fopen(tmp, "w");
+  if (fp == NULL) return -1;
+  const int ok = fwrite(text, 1, len < sizeof(text) ? len : sizeof(text) - 1, fp) > 0;
+  if (fclose(fp) != 0 || !ok || rename(tmp, path) != 0) {
+    remove(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+static void *dumper_driver(void *_dumper) {
+  const struct metrics_dumper *dumper = _dumper;
+  const struct timespec step = { .tv_sec = 0, .tv_nsec = 100000000 };
+  int waited = 0;
+
+  while (!dumper->exiting) {
+    nanosleep(&step, NULL);
+    waited += 100;
+    if (waited < dumper->interval_ms) continue;
+    waited = 0;
+    if (metrics_dump(dumper->path) < 0) fprintf(stderr, "[K808 ERROR]: Can't write metrics to %s.\n", dumper->path);
+  }
+  return NULL;
+}
+
+struct metrics_dumper *init_metrics_dumper(const char *path, const int interval_ms) {
+  struct metrics_dumper *res = malloc(sizeof(struct metrics_dumper));
+  res->path = strdup(path);
+  res->interval_ms = interval_ms;
+  res->exiting = 0;
+  if (pthread_create(&res->thread, NULL, dumper_driver, res) != 0) {
+    free(res->path);
+    free(res);
+    return NULL;
+  }
+  return res;
+}
+
+void free_metrics_dumper(struct metrics_dumper *dumper) {
+  if (dumper == NULL) return;
+  dumper->exiting = 1;
+  pthread_join(dumper->thread, NULL);
+  metrics_dump(dumper->path);
+  free(dumper->path);
+  free(dumper);
+}
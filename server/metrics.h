@@ -0,0 +1,42 @@
+//
+// Created by jay on 1/13/25.
+//
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Shard 0 is shared by every thread that isn't a device thread; device n writes to shard n + 1.
+#define METRICS_SHARDS 64
+
+enum metric {
+  METRIC_EVENTS_READ = 0,
+  METRIC_UNKNOWN_CODES,
+  METRIC_HANDLER_MISSES,
+  METRIC_INPUT_OVERFLOWS,
+  METRIC_OUTPUT_FAILURES,
+  METRIC_REJECTED_MESSAGES,
+  METRIC_THREAD_EXITS,
+  METRIC_DEVICE_THREADS,
+  METRIC_CONNECTIONS,
+
+  METRIC_COUNT
+};
+
+struct metrics_dumper;
+
+// Every thread counts into its own shard; shards are only summed when the metrics are read.
+void metrics_bind_device(int device);
+void metrics_add(enum metric metric, int64_t delta);
+int64_t metrics_get(enum metric metric);
+// Prometheus text format; returns the length it needed, like snprintf.
+size_t metrics_export(char *buf, size_t cap);
+int metrics_dump(const char *path);
+
+// Periodically rewrites path for a textfile collector (written to a temporary file, then renamed).
+struct metrics_dumper *init_metrics_dumper(const char *path, int interval_ms);
+void free_metrics_dumper(struct metrics_dumper *dumper);
+
+#endif //METRICS_H
@@ -17,21 +17,28 @@ struct mutex *new_mutex(void) {
   return res;
 }
 
+static int try_acquire(struct mutex *mutex, const int thread_id) {
+  int expected = -1;
+  return __atomic_compare_exchange_n(&mutex->current_thread, &expected, thread_id, 0, __ATOMIC_ACQUIRE,
+    __ATOMIC_RELAXED);
+}
+
 void mutex_acquire_sync(struct mutex *mutex, const int thread_id) {
-  if (mutex->current_thread == thread_id) return;
-  while (!__sync_bool_compare_and_swap(&mutex->current_thread, -1, thread_id)) {
+  if (__atomic_load_n(&mutex->current_thread, __ATOMIC_RELAXED) == thread_id) return;
+  while (!try_acquire(mutex, thread_id)) {
     sched_yield();
   }
 }
 
 int mutex_acquire_async(struct mutex *mutex, const int thread_id) {
-  if (mutex->current_thread == thread_id) return 1;
-  return __sync_bool_compare_and_swap(&mutex->current_thread, -1, thread_id);
+  if (__atomic_load_n(&mutex->current_thread, __ATOMIC_RELAXED) == thread_id) return 1;
+  return try_acquire(mutex, thread_id);
 }
 
+// the release store publishes everything written while the mutex was held to the next owner
 void mutex_release(struct mutex *mutex, const int thread_id) {
-  if (mutex->current_thread == thread_id) {
-    mutex->current_thread = -1;
+  if (__atomic_load_n(&mutex->current_thread, __ATOMIC_RELAXED) == thread_id) {
+    __atomic_store_n(&mutex->current_thread, -1, __ATOMIC_RELEASE);
   }
 }
 
@@ -0,0 +1,310 @@
+//
+// Created by jay on 1/7/25.
+//
+
+#include "output.h"
+#include "k808_context.h"
+#include "metrics.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <time.h>
+#include <linux/uinput.h>
+
+#define KEY_WORDS ((KEY_CNT + 63) / 64)
+#define REL_WORDS ((REL_CNT + 63) / 64)
+
+struct capabilities {
+  uint64_t keys[KEY_WORDS];
+  uint64_t rels[REL_WORDS];
+  int count;
+};
+
+struct output_report {
+  int starts[OUTPUT_DEVICE_COUNT];
+  int counts[OUTPUT_DEVICE_COUNT]; // including the SYN_REPORT, 0 if nothing goes to that device
+  int size;                        // events, excluding the SYN_REPORTs
+  struct input_event events[];
+};
+
+struct output {
+  FILE *logger;
+  uint8_t routes[KEY_CNT];
+  struct capabilities caps[OUTPUT_DEVICE_COUNT];
+  struct capabilities dropped; // codes already reported as undeclared; only updated atomically
+  int fds[OUTPUT_DEVICE_COUNT];
+};
+
+static const struct {
+  const char *name;
+  uint16_t product;
+} device_info[OUTPUT_DEVICE_COUNT] = {
+  [OUTPUT_KEYBOARD] = { "K808 [REMAP]", K808_REMAPPED_PRODUCT },
+  [OUTPUT_CONSUMER] = { "K808 [MEDIA]", K808_REMAPPED_PRODUCT + 1 },
+  [OUTPUT_POINTER] = { "K808 [POINTER]", K808_REMAPPED_PRODUCT + 2 },
+};
+
+// Keys that desktops expect on a consumer-control device rather than on a keyboard.
+static const uint16_t consumer_keys[] = {
+  KEY_MUTE, KEY_VOLUMEDOWN, KEY_VOLUMEUP, KEY_PLAYPAUSE, KEY_PLAYCD, KEY_PAUSECD, KEY_STOPCD, KEY_NEXTSONG,
+  KEY_PREVIOUSSONG, KEY_EJECTCD, KEY_FASTFORWARD, KEY_REWIND, KEY_RECORD, KEY_MEDIA, KEY_BRIGHTNESSDOWN,
+  KEY_BRIGHTNESSUP, KEY_CALC, KEY_MAIL, KEY_WWW, KEY_HOMEPAGE, KEY_BACK, KEY_FORWARD, KEY_REFRESH, KEY_SEARCH,
+  KEY_BOOKMARKS, KEY_COMPUTER, KEY_CONFIG, KEY_SLEEP, KEY_WAKEUP, KEY_POWER
+};
+
+static void output_log(FILE *fd, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  vfprintf(fd, fmt, args);
+  va_end(args);
+}
+
+static double elapsed_ms(const struct timespec *since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since->tv_sec) * 1e3 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+static void set_bit(uint64_t *words, const uint16_t bit, int *count) {
+  if (!(words[bit / 64] & 1ull << bit % 64)) {
+    words[bit / 64] |= 1ull << bit % 64;
+    (*count)++;
+  }
+}
+
+struct output *init_output(FILE *logger) {
+  struct output *res = calloc(1, sizeof(struct output));
+  res->logger = logger;
+  for (int i = 0; i < OUTPUT_DEVICE_COUNT; i++) res->fds[i] = -1;
+
+  for (int i = 0; i < KEY_CNT; i++) res->routes[i] = OUTPUT_KEYBOARD;
+  for (int i = BTN_MOUSE; i <= BTN_TASK; i++) res->routes[i] = OUTPUT_POINTER;
+  for (size_t i = 0; i < sizeof(consumer_keys) / sizeof(consumer_keys[0]); i++) {
+    res->routes[consumer_keys[i]] = OUTPUT_CONSUMER;
+  }
+  return res;
+}
+
+void output_require(struct output *out, const uint16_t type, const uint16_t code) {
+  if (type == EV_KEY && code < KEY_CNT) {
+    struct capabilities *caps = &out->caps[out->routes[code]];
+    set_bit(caps->keys, code, &caps->count);
+  }
+  else if (type == EV_REL && code < REL_CNT) {
+    struct capabilities *caps = &out->caps[OUTPUT_POINTER];
+    set_bit(caps->rels, code, &caps->count);
+  }
+}
+
+static int create_device(const struct output *out, const enum output_device device, const struct capabilities *caps) {
+  const int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+  if (fd < 0) {
+    output_log(out->logger, "[K808 ERROR]: Can't open /dev/uinput: %s\n", strerror(errno));
+    return -1;
+  }
+
+  int has_keys = 0, has_rels = 0;
+  for (int i = 0; i < KEY_WORDS; i++) has_keys |= caps->keys[i] != 0;
+  for (int i = 0; i < REL_WORDS; i++) has_rels |= caps->rels[i] != 0;
+
+  if (has_keys) {
+    ioctl(fd, UI_SET_EVBIT, EV_KEY);
+    for (int i = 0; i < KEY_CNT; i++) {
+      if (caps->keys[i / 64] & 1ull << i % 64) ioctl(fd, UI_SET_KEYBIT, i);
+    }
+  }
+  if (has_rels) {
+    ioctl(fd, UI_SET_EVBIT, EV_REL);
+    for (int i = 0; i < REL_CNT; i++) {
+      if (caps->rels[i / 64] & 1ull << i % 64) ioctl(fd, UI_SET_RELBIT, i);
+    }
+  }
+
+  struct uinput_setup setup = {
+    .id = {
+      .bustype = BUS_USB,
+      .vendor = K808_REMAPPED_VENDOR,
+      .product = device_info[device].product
+    }
+  };
+  strncpy(setup.name, device_info[device].name, UINPUT_MAX_NAME_SIZE - 1);
+
+  if (ioctl(fd, UI_DEV_SETUP, &setup) < 0 || ioctl(fd, UI_DEV_CREATE) < 0) {
+    output_log(out->logger, "[K808 ERROR]: Can't create uinput device %s: %s\n", setup.name, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  output_log(out->logger, "[K808 INFO]: Created uinput device at %x:%x as %s (fd %d, %d capabilities).\n",
+    setup.id.vendor, setup.id.product, setup.name, fd, caps->count);
+  return fd;
+}
+
+int output_create(struct output *out) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int total = 0;
+  for (int i = 0; i < OUTPUT_DEVICE_COUNT; i++) total += out->caps[i].count;
+  if (total == 0) {
+    // nothing was declared; behave like a plain keyboard for the classic key range
+    output_log(out->logger, "[K808 INFO]: No output keys declared, advertising the full keyboard range.\n");
+    for (int i = 1; i < 256; i++) output_require(out, EV_KEY, i);
+  }
+
+  if (out->caps[OUTPUT_POINTER].count > 0) {
+    // libinput only treats a device with relative axes as a pointer
+    output_require(out, EV_REL, REL_X);
+    output_require(out, EV_REL, REL_Y);
+  }
+
+  for (int i = 0; i < OUTPUT_DEVICE_COUNT; i++) {
+    if (out->caps[i].count == 0 || out->fds[i] >= 0) continue;
+
+    struct timespec device_start;
+    clock_gettime(CLOCK_MONOTONIC, &device_start);
+    out->fds[i] = create_device(out, i, &out->caps[i]);
+    if (out->fds[i] < 0) return -1;
+    output_log(out->logger, "[K808 INFO]: Device %s took %.3f ms to create.\n", device_info[i].name, elapsed_ms(&device_start));
+  }
+
+  output_log(out->logger, "[K808 INFO]: Output devices ready in %.3f ms.\n", elapsed_ms(&start));
+  return 0;
+}
+
+int output_supports(const struct output *out, const uint16_t type, const uint16_t code) {
+  if (type == EV_KEY && code < KEY_CNT) {
+    const enum output_device device = out->routes[code];
+    return out->fds[device] >= 0 && out->caps[device].keys[code / 64] & 1ull << code % 64;
+  }
+  if (type == EV_REL && code < REL_CNT) {
+    return out->fds[OUTPUT_POINTER] >= 0 && out->caps[OUTPUT_POINTER].rels[code / 64] & 1ull << code % 64;
+  }
+  return 0;
+}
+
+int output_device_fd(const struct output *out, const enum output_device device) {
+  return out->fds[device];
+}
+
+enum output_device output_route(const struct output *out, const uint16_t type, const uint16_t code) {
+  if (type == EV_REL) return OUTPUT_POINTER;
+  if (type == EV_KEY && code < KEY_CNT) return out->routes[code];
+  return OUTPUT_KEYBOARD;
+}
+
+// uinput silently ignores codes its device didn't declare, so they're filtered out here and each one is reported once.
+static int check_declared(const struct output *out, const struct input_event *event) {
+  if (output_supports(out, event->type, event->code)) return 1;
+
+  uint64_t *words = NULL;
+  if (event->type == EV_KEY && event->code < KEY_CNT) words = (uint64_t *)out->dropped.keys;
+  else if (event->type == EV_REL && event->code < REL_CNT) words = (uint64_t *)out->dropped.rels;
+  const uint64_t bit = 1ull << event->code % 64;
+  if (words == NULL || !(__atomic_fetch_or(&words[event->code / 64], bit, __ATOMIC_RELAXED) & bit)) {
+    output_log(out->logger, "[K808 WARN]: Dropping events of type %d, code %d: not declared for the output devices.\n",
+      event->type, event->code);
+  }
+  return 0;
+}
+
+// Every device gets all of its events in a single frame (one SYN_REPORT at the end), however many there are, so a
+// combination is never split; requests beyond OUTPUT_BATCH events are buffered on the heap.
+int output_write(const struct output *out, const struct input_event *events, const int count) {
+  struct input_event local[OUTPUT_BATCH + OUTPUT_DEVICE_COUNT];
+  const size_t cap = count + OUTPUT_DEVICE_COUNT;
+  struct input_event *batch = cap <= sizeof(local) / sizeof(local[0]) ? local : malloc(cap * sizeof(struct input_event));
+  if (batch == NULL) {
+    metrics_add(METRIC_OUTPUT_FAILURES, 1);
+    return -1;
+  }
+
+  int counts[OUTPUT_DEVICE_COUNT] = { 0 };
+  for (int i = 0; i < count; i++) {
+    if (check_declared(out, events + i)) counts[output_route(out, events[i].type, events[i].code)]++;
+  }
+
+  int starts[OUTPUT_DEVICE_COUNT];
+  int start = 0;
+  for (int i = 0; i < OUTPUT_DEVICE_COUNT; i++) {
+    starts[i] = start;
+    start += counts[i] > 0 ? counts[i] + 1 : 0;
+    counts[i] = 0;
+  }
+  for (int i = 0; i < count; i++) {
+    if (!output_supports(out, events[i].type, events[i].code)) continue;
+    const enum output_device device = output_route(out, events[i].type, events[i].code);
+    batch[starts[device] + counts[device]++] = events[i];
+  }
+
+  int failed = 0;
+  for (int i = 0; i < OUTPUT_DEVICE_COUNT; i++) {
+    if (counts[i] == 0) continue;
+    batch[starts[i] + counts[i]] = (struct input_event){ .type = EV_SYN, .code = SYN_REPORT, .value = 0 };
+    const ssize_t size = (counts[i] + 1) * sizeof(struct input_event);
+    if (write(out->fds[i], batch + starts[i], size) == size) continue;
+    metrics_add(METRIC_OUTPUT_FAILURES, 1);
+    failed = 1;
+  }
+
+  if (batch != local) free(batch);
+  return failed ? -1 : 0;
+}
+
+struct output_report *output_compile(const struct output *out, const struct input_event *events, const int count) {
+  int counts[OUTPUT_DEVICE_COUNT] = { 0 };
+  for (int i = 0; i < count; i++) counts[output_route(out, events[i].type, events[i].code)]++;
+
+  int total = 0;
+  for (int i = 0; i < OUTPUT_DEVICE_COUNT; i++) total += counts[i] > 0 ? counts[i] + 1 : 0;
+  struct output_report *res = calloc(1, sizeof(struct output_report) + total * sizeof(struct input_event));
+  if (res == NULL) return NULL;
+  res->size = count;
+
+  int start = 0;
+  for (int i = 0; i < OUTPUT_DEVICE_COUNT; i++) {
+    if (counts[i] == 0) continue;
+    res->starts[i] = start;
+    for (int j = 0; j < count; j++) {
+      if (output_route(out, events[j].type, events[j].code) != (enum output_device)i) continue;
+      res->events[start + res->counts[i]++] = (struct input_event){ .type = events[j].type, .code = events[j].code, .value = events[j].value };
+    }
+    res->events[start + res->counts[i]++] = (struct input_event){ .type = EV_SYN, .code = SYN_REPORT, .value = 0 };
+    start += res->counts[i];
+  }
+  return res;
+}
+
+// uinput stamps events itself, so the buffers are written as they are.
+int output_emit(const struct output *out, const struct output_report *report) {
+  int failed = 0;
+  for (int i = 0; i < OUTPUT_DEVICE_COUNT; i++) {
+    if (report->counts[i] == 0 || out->fds[i] < 0) continue;
+    const ssize_t size = report->counts[i] * sizeof(struct input_event);
+    if (write(out->fds[i], report->events + report->starts[i], size) == size) continue;
+    metrics_add(METRIC_OUTPUT_FAILURES, 1);
+    failed = 1;
+  }
+  return failed ? -1 : 0;
+}
+
+int output_report_size(const struct output_report *report) {
+  return report->size;
+}
+
+void free_output_report(struct output_report *report) {
+  free(report);
+}
+
+void free_output(struct output *out) {
+  for (int i = 0; i < OUTPUT_DEVICE_COUNT; i++) {
+    if (out->fds[i] < 0) continue;
+    ioctl(out->fds[i], UI_DEV_DESTROY);
+    close(out->fds[i]);
+  }
+  free(out);
+}
@@ -0,0 +1,38 @@
+//
+// Created by jay on 1/7/25.
+//
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <linux/input.h>
+
+// Events output_write buffers on the stack; larger writes are still a single frame, from a heap buffer.
+#define OUTPUT_BATCH 64
+
+enum output_device {
+  OUTPUT_KEYBOARD = 0, OUTPUT_CONSUMER, OUTPUT_POINTER,
+
+  OUTPUT_DEVICE_COUNT
+};
+
+struct output;
+struct output_report;
+
+struct output *init_output(FILE *logger);
+void output_require(struct output *out, uint16_t type, uint16_t code);
+int output_create(struct output *out);
+int output_supports(const struct output *out, uint16_t type, uint16_t code);
+int output_device_fd(const struct output *out, enum output_device device);
+enum output_device output_route(const struct output *out, uint16_t type, uint16_t code);
+int output_write(const struct output *out, const struct input_event *events, int count);
+// Precompiles events into per-device, SYN-terminated buffers; emitting one is a single write per device.
+struct output_report *output_compile(const struct output *out, const struct input_event *events, int count);
+int output_emit(const struct output *out, const struct output_report *report);
+int output_report_size(const struct output_report *report);
+void free_output_report(struct output_report *report);
+void free_output(struct output *out);
+
+#endif //OUTPUT_H
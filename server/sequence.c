@@ -0,0 +1,252 @@
+//
+// Created by jay on 1/4/25.
+//
+
+#include "sequence.h"
+#include "vector.h"
+#include "trace.h"
+#include "hash.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Sequences are compiled into a dense DFA: one row of K808_KEY_COUNT transitions per trie node, so stepping costs a
+// single table lookup regardless of how many sequences are registered. Node 0 is the root and is never a target, so a
+// zero transition means "no such continuation".
+struct sequence_node {
+  int32_t next[K808_KEY_COUNT];
+  int32_t action;
+  int32_t children;
+};
+
+struct sequence_def {
+  enum k808_key keys[K808_MAX_SEQUENCE];
+  int count;
+  k808_sequence_handler handler;
+  void *user_data;
+};
+
+struct sequence_table {
+  struct vector *defs;
+  struct sequence_node *nodes;
+  int node_count;
+  uint64_t timeout_ms;
+};
+
+static void free_nothing(void *) {}
+
+struct sequence_table *init_sequence_table(void) {
+  struct sequence_table *res = malloc(sizeof(struct sequence_table));
+  res->defs = init_vector(sizeof(struct sequence_def));
+  res->nodes = NULL;
+  res->node_count = 0;
+  res->timeout_ms = K808_DEFAULT_SEQUENCE_TIMEOUT_MS;
+  return res;
+}
+
+int sequence_table_add(struct sequence_table *table, const enum k808_key *keys, const int count,
+                       const k808_sequence_handler handler, void *user_data) {
+  if (count <= 0 || count > K808_MAX_SEQUENCE || handler == NULL) return -1;
+  for (int i = 0; i < count; i++) {
+    if (keys[i] < 0 || keys[i] >= K808_KEY_COUNT) return -1;
+  }
+
+  struct sequence_def def = { .count = count, .handler = handler, .user_data = user_data };
+  memcpy(def.keys, keys, count * sizeof(enum k808_key));
+  push_back(table->defs, &def);
+  return 0;
+}
+
+int sequence_table_compile(struct sequence_table *table) {
+  struct vector *nodes = init_vector(sizeof(struct sequence_node));
+  const struct sequence_node empty = { .next = { 0 }, .action = -1, .children = 0 };
+  push_back(nodes, &empty);
+
+  for (int i = 0; i < vector_size(table->defs); i++) {
+    const struct sequence_def *def = vector_at(table->defs, i);
+    int32_t curr = 0;
+    for (int j = 0; j < def->count; j++) {
+      struct sequence_node *node = vector_at(nodes, curr);
+      if (node->next[def->keys[j]] == 0) {
+        node->next[def->keys[j]] = vector_size(nodes);
+        node->children++;
+        push_back(nodes, &empty);
+        node = vector_at(nodes, curr); // push_back may have moved the storage
+      }
+      curr = node->next[def->keys[j]];
+    }
+    // later registrations of the same sequence win
+    ((struct sequence_node *)vector_at(nodes, curr))->action = i;
+  }
+
+  struct sequence_node *compiled = malloc(vector_size(nodes) * sizeof(struct sequence_node));
+  if (compiled == NULL) {
+    free_vector(nodes, free_nothing);
+    return -1;
+  }
+  memcpy(compiled, vector_at(nodes, 0), vector_size(nodes) * sizeof(struct sequence_node));
+
+  free(table->nodes);
+  table->nodes = compiled;
+  table->node_count = vector_size(nodes);
+  free_vector(nodes, free_nothing);
+  return 0;
+}
+
+int sequence_table_size(const struct sequence_table *table) {
+  return vector_size(table->defs);
+}
+
+int sequence_table_node_count(const struct sequence_table *table) {
+  return table->node_count;
+}
+
+void sequence_table_set_timeout(struct sequence_table *table, const int timeout_ms) {
+  table->timeout_ms = timeout_ms > 0 ? timeout_ms : K808_DEFAULT_SEQUENCE_TIMEOUT_MS;
+}
+
+// Identifies the registered key sequences (not their handlers, whose addresses change between runs), so a compiled
+// table can only be imported into a run that registered exactly the same sequences in the same order.
+uint32_t sequence_table_fingerprint(const struct sequence_table *table) {
+  const uint32_t layout[] = { K808_KEY_COUNT, K808_MAX_SEQUENCE, sizeof(struct sequence_node) };
+  uint32_t hash = hash_bytes(HASH_SEED, layout, sizeof(layout));
+  for (int i = 0; i < vector_size(table->defs); i++) {
+    const struct sequence_def *def = vector_at(table->defs, i);
+    hash = hash_bytes(hash, &def->count, sizeof(def->count));
+    hash = hash_bytes(hash, def->keys, def->count * sizeof(enum k808_key));
+  }
+  return hash;
+}
+
+size_t sequence_table_export(const struct sequence_table *table, void *dst, const size_t cap) {
+  const size_t len = table->node_count * sizeof(struct sequence_node);
+  if (dst != NULL && cap >= len) memcpy(dst, table->nodes, len);
+  return len;
+}
+
+int sequence_table_import(struct sequence_table *table, const void *src, const size_t len) {
+  if (len == 0 || len % sizeof(struct sequence_node) != 0) return -1;
+
+  const int count = len / sizeof(struct sequence_node);
+  struct sequence_node *nodes = malloc(len);
+  if (nodes == NULL) return -1;
+  memcpy(nodes, src, len);
+
+  for (int i = 0; i < count; i++) {
+    // every leaf has to fire something, and actions have to refer to a registered sequence
+    int valid = nodes[i].action >= -1 && nodes[i].action < vector_size(table->defs) &&
+                (i == 0 || nodes[i].children > 0 || nodes[i].action >= 0);
+    for (int k = 0; k < K808_KEY_COUNT; k++) valid &= nodes[i].next[k] >= 0 && nodes[i].next[k] < count;
+    if (!valid) {
+      free(nodes);
+      return -1;
+    }
+  }
+
+  free(table->nodes);
+  table->nodes = nodes;
+  table->node_count = count;
+  return 0;
+}
+
+void free_sequence_table(struct sequence_table *table) {
+  free_vector(table->defs, free_nothing);
+  free(table->nodes);
+  free(table);
+}
+
+// Keys that are still physically held when the buffer is discarded have their releases swallowed later on.
+static void reset(struct sequence_state *state) {
+  for (int i = 0; i < state->depth; i++) {
+    if (state->held[i]) state->swallow[state->buffer[i]]++;
+  }
+  state->node = 0;
+  state->depth = 0;
+}
+
+static void fire(const struct sequence_table *table, struct sequence_state *state, const int32_t action) {
+  const struct sequence_def *def = vector_at(table->defs, action);
+  enum k808_key keys[K808_MAX_SEQUENCE];
+  const int count = state->depth;
+  memcpy(keys, state->buffer, count * sizeof(enum k808_key));
+  reset(state);
+  K808_TRACE(sequence_match, action, count);
+  def->handler(keys, count, def->user_data);
+}
+
+// Replays the buffered keys as plain key events; held keys only get their press, their real release passes through.
+static void replay_buffer(struct sequence_state *state, const sequence_replay replay, void *replay_data) {
+  enum k808_key keys[K808_MAX_SEQUENCE];
+  uint8_t held[K808_MAX_SEQUENCE];
+  const int count = state->depth;
+  memcpy(keys, state->buffer, count * sizeof(enum k808_key));
+  memcpy(held, state->held, count * sizeof(uint8_t));
+  state->node = 0;
+  state->depth = 0;
+
+  for (int i = 0; i < count; i++) {
+    replay(keys[i], K808_KEY_PRESS, replay_data);
+    if (!held[i]) replay(keys[i], K808_KEY_RELEASE, replay_data);
+  }
+}
+
+static void resolve(const struct sequence_table *table, struct sequence_state *state, const sequence_replay replay,
+                    void *replay_data) {
+  const int32_t action = table->nodes[state->node].action;
+  if (action >= 0) fire(table, state, action);
+  else replay_buffer(state, replay, replay_data);
+}
+
+void sequence_poll(const struct sequence_table *table, struct sequence_state *state, const uint64_t now_ms,
+                   const sequence_replay replay, void *replay_data) {
+  if (state->node == 0 || now_ms - state->last_ms < table->timeout_ms) return;
+  resolve(table, state, replay, replay_data);
+}
+
+int sequence_feed(const struct sequence_table *table, struct sequence_state *state, const enum k808_key key,
+                  const enum k808_event event, const uint64_t now_ms, const sequence_replay replay, void *replay_data) {
+  if (table == NULL || table->node_count <= 1) return 0;
+
+  if (event == K808_KEY_RELEASE) {
+    for (int i = state->depth - 1; i >= 0; i--) {
+      if (state->buffer[i] == key && state->held[i]) {
+        state->held[i] = 0;
+        return 1;
+      }
+    }
+    if (state->swallow[key] > 0) {
+      state->swallow[key]--;
+      return 1;
+    }
+    return 0;
+  }
+
+  sequence_poll(table, state, now_ms, replay, replay_data);
+
+  const int32_t next = table->nodes[state->node].next[key];
+  if (next == 0) {
+    if (state->node == 0) return 0;
+    // the pending prefix can't be continued; settle it, then retry this key as the start of a new sequence
+    resolve(table, state, replay, replay_data);
+    return sequence_feed(table, state, key, event, now_ms, replay, replay_data);
+  }
+
+  state->buffer[state->depth] = key;
+  state->held[state->depth] = 1;
+  state->depth++;
+  state->node = next;
+  state->last_ms = now_ms;
+
+  if (table->nodes[next].children == 0) {
+    fire(table, state, table->nodes[next].action);
+  }
+  return 1;
+}
+
+int sequence_owns(const struct sequence_state *state, const enum k808_key key) {
+  if (state->swallow[key] > 0) return 1;
+  for (int i = 0; i < state->depth; i++) {
+    if (state->buffer[i] == key && state->held[i]) return 1;
+  }
+  return 0;
+}
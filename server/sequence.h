@@ -0,0 +1,47 @@
+//
+// Created by jay on 1/4/25.
+//
+
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include "k808_context.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define K808_DEFAULT_SEQUENCE_TIMEOUT_MS 1000
+
+struct sequence_table;
+
+// Per-device matcher position; zero-initialize before first use.
+struct sequence_state {
+  int32_t node;
+  int depth;
+  enum k808_key buffer[K808_MAX_SEQUENCE];
+  uint8_t held[K808_MAX_SEQUENCE];
+  uint8_t swallow[K808_KEY_COUNT];
+  uint64_t last_ms;
+};
+
+// Invoked for every buffered key that turned out not to be part of a sequence.
+typedef void (*sequence_replay)(enum k808_key key, enum k808_event event, void *user_data);
+
+struct sequence_table *init_sequence_table(void);
+int sequence_table_add(struct sequence_table *table, const enum k808_key *keys, int count, k808_sequence_handler handler, void *user_data);
+int sequence_table_compile(struct sequence_table *table);
+int sequence_table_size(const struct sequence_table *table);
+int sequence_table_node_count(const struct sequence_table *table);
+void sequence_table_set_timeout(struct sequence_table *table, int timeout_ms);
+uint32_t sequence_table_fingerprint(const struct sequence_table *table);
+size_t sequence_table_export(const struct sequence_table *table, void *dst, size_t cap);
+int sequence_table_import(struct sequence_table *table, const void *src, size_t len);
+void free_sequence_table(struct sequence_table *table);
+
+int sequence_feed(const struct sequence_table *table, struct sequence_state *state, enum k808_key key, enum k808_event event,
+                  uint64_t now_ms, sequence_replay replay, void *replay_data);
+void sequence_poll(const struct sequence_table *table, struct sequence_state *state, uint64_t now_ms,
+                   sequence_replay replay, void *replay_data);
+int sequence_owns(const struct sequence_state *state, enum k808_key key);
+
+#endif //SEQUENCE_H
@@ -5,22 +5,52 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
 
 #include "server.h"
+#include "vector.h"
+#include "trace.h"
+#include "metrics.h"
+
+// Client sockets are nonblocking: replies are queued in out and sent as the socket takes them. Once more than a
+// message's worth is queued, no further frames are handled (or read) until the client catches up.
+struct connection {
+  int fd;
+  char *buf;
+  size_t len;
+  size_t cap;
+  char *out;
+  size_t out_len;
+  size_t out_cap;
+  int broken;
+};
 
 struct server {
   message_handler handler;
   void *user;
-  const char *sock_file;
+  char *sock_file;
   int fd;
   struct sockaddr_un addr;
+  struct vector *conns;
+  struct connection *reply_to;
   volatile int exiting;
 };
 
+static void free_connection(void *c) {
+  struct connection *conn = c;
+  close(conn->fd);
+  free(conn->buf);
+  free(conn->out);
+  metrics_add(METRIC_CONNECTIONS, -1);
+}
+
 struct server *init_server(const char *sock_file, message_handler handler, void *user_data) {
   struct server *res = malloc(sizeof(struct server));
   res->fd = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -44,28 +74,168 @@ struct server *init_server(const char *sock_file, message_handler handler, void
   res->handler = handler;
   res->user = user_data;
   res->sock_file = strdup(sock_file);
+  res->conns = init_vector(sizeof(struct connection));
+  res->reply_to = NULL;
   res->exiting = 0;
   return res;
 }
 
+// Splits the connection's buffer into frames and hands each to the handler. Returns 0 if the connection should close.
+static int dispatch_frames(struct server *srv, struct connection *conn) {
+  size_t off = 0;
+  int keep = 1;
+  srv->reply_to = conn;
+
+  while (keep && conn->out_len <= SERVER_MAX_MESSAGE && conn->len - off >= SERVER_HEADER_SIZE) {
+    uint32_t payload;
+    memcpy(&payload, conn->buf + off + 4, sizeof(payload));
+    if (memcmp(conn->buf + off, "K8", 2) != 0 || payload > SERVER_MAX_MESSAGE - SERVER_HEADER_SIZE) {
+      // not a frame we understand; let the handler report it, then drop the connection
+      srv->handler(srv, conn->len - off, conn->buf + off, srv->user);
+      keep = 0;
+      break;
+    }
+
+    const size_t frame = SERVER_HEADER_SIZE + payload;
+    if (conn->len - off < frame) break;
+
+    K808_TRACE(socket_message, conn->fd, frame);
+    keep = srv->handler(srv, frame, conn->buf + off, srv->user) == SERVER_KEEP_ALIVE;
+    off += frame;
+  }
+
+  srv->reply_to = NULL;
+  memmove(conn->buf, conn->buf + off, conn->len - off);
+  conn->len -= off;
+  return keep && !conn->broken;
+}
+
+// Sends as much of the queued output as the socket takes. Returns 0 if the connection should close.
+static int flush_output(struct connection *conn) {
+  size_t off = 0;
+  while (off < conn->out_len) {
+    const ssize_t wr = send(conn->fd, conn->out + off, conn->out_len - off, MSG_NOSIGNAL);
+    if (wr < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) break;
+    if (wr <= 0) return 0;
+    off += wr;
+  }
+  memmove(conn->out, conn->out + off, conn->out_len - off);
+  conn->out_len -= off;
+  return 1;
+}
+
+// Handles the frames that are already buffered and sends what they produced, for as long as the socket keeps up; once
+// it doesn't, the rest waits for POLLOUT. Returns 0 if the connection should close.
+static int serve(struct server *srv, struct connection *conn) {
+  while (flush_output(conn)) {
+    if (conn->out_len > SERVER_MAX_MESSAGE) return 1;
+
+    const size_t buffered = conn->len;
+    if (!dispatch_frames(srv, conn)) {
+      flush_output(conn); // best effort, e.g. the error reply to a frame that closes the connection
+      return 0;
+    }
+    if (conn->len == buffered) return 1;
+  }
+  return 0;
+}
+
+static int on_readable(struct server *srv, struct connection *conn) {
+  if (conn->cap - conn->len < 4096) {
+    const size_t cap = conn->cap == 0 ? 8192 : conn->cap * 2;
+    if (cap > 2 * SERVER_MAX_MESSAGE) return 0;
+    char *copy = realloc(conn->buf, cap);
+    if (copy == NULL) return 0;
+    conn->buf = copy;
+    conn->cap = cap;
+  }
+
+  const ssize_t rd = recv(conn->fd, conn->buf + conn->len, conn->cap - conn->len, 0);
+  if (rd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 1;
+  if (rd <= 0) return 0;
+  conn->len += rd;
+  return serve(srv, conn);
+}
+
+// Returns 0 if the connection should close.
+static int on_event(struct server *srv, struct connection *conn, const short requested, const short revents) {
+  if (revents & POLLOUT && !serve(srv, conn)) return 0;
+  if (revents & POLLIN) return on_readable(srv, conn);
+  // errors and hang-ups are only noticed by reading while input is accepted; while it isn't, they end the connection
+  return !(revents & (POLLERR | POLLHUP | POLLNVAL)) || (requested & POLLIN && on_readable(srv, conn));
+}
+
+static void free_nothing(void *) {}
+
 void server_run(struct server *srv) {
   if (listen(srv->fd, 4096) == -1) return;
 
+  struct pollfd *fds = NULL;
   while (!srv->exiting) {
-    char buf[4096];
-    const int accept_fd = accept(srv->fd, NULL, NULL);
-    if (accept_fd == -1) return;
-
-    size_t len = recv(accept_fd, buf, sizeof(buf), 0);
-    while (len != 0) {
-      const enum server_response resp = srv->handler(srv, len, buf, srv->user);
-      if (resp == SERVER_CLOSE_CONN) {
+    const int count = vector_size(srv->conns);
+    struct pollfd *copy = realloc(fds, (count + 1) * sizeof(struct pollfd));
+    if (copy == NULL) break;
+    fds = copy;
+
+    fds[0] = (struct pollfd){ .fd = srv->fd, .events = POLLIN };
+    for (int i = 0; i < count; i++) {
+      const struct connection *conn = vector_at(srv->conns, i);
+      const short events = (conn->out_len <= SERVER_MAX_MESSAGE ? POLLIN : 0) | (conn->out_len > 0 ? POLLOUT : 0);
+      fds[i + 1] = (struct pollfd){ .fd = conn->fd, .events = events };
+    }
+
+    if (poll(fds, count + 1, -1) == -1) {
+      if (errno == EINTR) continue;
+      break;
+    }
+
+    // connections are polled in the order they're stored; dead ones are compacted out afterwards
+    struct vector *alive = init_vector(sizeof(struct connection));
+    for (int i = 0; i < count; i++) {
+      struct connection *conn = vector_at(srv->conns, i);
+      if (fds[i + 1].revents == 0 || (!srv->exiting && on_event(srv, conn, fds[i + 1].events, fds[i + 1].revents))) {
+        push_back(alive, conn);
+      }
+      else {
+        free_connection(conn);
+      }
+    }
+    free_vector(srv->conns, free_nothing);
+    srv->conns = alive;
+
+    if (fds[0].revents & POLLIN) {
+      const int accept_fd = accept(srv->fd, NULL, NULL);
+      if (accept_fd != -1 && fcntl(accept_fd, F_SETFL, fcntl(accept_fd, F_GETFL) | O_NONBLOCK) == -1) {
         close(accept_fd);
-        break;
       }
-      len = recv(accept_fd, buf, sizeof(buf), 0);
+      else if (accept_fd != -1) {
+        const struct connection conn = { .fd = accept_fd };
+        push_back(srv->conns, &conn);
+        metrics_add(METRIC_CONNECTIONS, 1);
+      }
     }
   }
+  free(fds);
+}
+
+// Only queues the reply; it's sent once the handler returns (and the client reads it).
+void server_reply(const struct server *srv, const char *msg, const size_t len) {
+  struct connection *conn = srv->reply_to;
+  if (conn == NULL || conn->broken) return;
+
+  if (conn->out_cap - conn->out_len < len) {
+    size_t cap = conn->out_cap == 0 ? 8192 : conn->out_cap;
+    while (cap - conn->out_len < len) cap *= 2;
+    char *copy = realloc(conn->out, cap);
+    if (copy == NULL) {
+      conn->broken = 1;
+      return;
+    }
+    conn->out = copy;
+    conn->out_cap = cap;
+  }
+  memcpy(conn->out + conn->out_len, msg, len);
+  conn->out_len += len;
 }
 
 void server_stop(struct server *srv) {
@@ -73,7 +243,9 @@ void server_stop(struct server *srv) {
 }
 
 void server_free(struct server *srv) {
+  free_vector(srv->conns, free_connection);
   close(srv->fd);
   remove(srv->sock_file);
+  free(srv->sock_file);
   free(srv);
-}
\ No newline at end of file
+}
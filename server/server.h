@@ -5,6 +5,12 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include <stddef.h>
+
+// Every message starts with a 4-byte magic ("K8..") followed by a uint32 payload length.
+#define SERVER_HEADER_SIZE 8
+#define SERVER_MAX_MESSAGE 65536
+
 struct server;
 
 enum server_response {
@@ -15,6 +21,7 @@ typedef enum server_response (*message_handler)(struct server *srv, size_t len,
 
 struct server *init_server(const char *sock_file, message_handler handler, void *user_data);
 void server_run(struct server *srv);
+void server_reply(const struct server *srv, const char *msg, size_t len);
 void server_stop(struct server *srv);
 void server_free(struct server *srv);
 
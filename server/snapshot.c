@@ -0,0 +1,274 @@
+//
+// Created by jay on 1/9/25.
+//
+
+#include "snapshot.h"
+#include "hash.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_MAGIC "K808SNAP"
+
+// The header and the compiled tables are only written once, by snapshot_commit at start-up.
+struct snapshot_header {
+  _Alignas(64) char magic[8];
+  uint32_t version;
+  uint32_t checksum; // over the header itself, computed with this field zeroed
+  uint64_t size;
+  uint32_t device_count;
+  uint32_t fingerprint;
+  uint64_t tables_len;
+  uint32_t tables_checksum;
+};
+
+// The control thread's stack, in a record of its own so rewriting it never puts the header (and so the whole file) at
+// risk; a torn write only loses the defaults.
+struct snapshot_default_stack {
+  _Alignas(64) int32_t depth;
+  int32_t stack[K808_MAX_LAYER_DEPTH];
+  uint32_t checksum;
+};
+
+// One slot per device, each on its own cache lines and written only by that device's thread. Every slot carries its
+// own checksum, so a torn write only invalidates that device's state.
+struct snapshot_slot {
+  _Alignas(64) char path[SNAPSHOT_PATH_LEN];
+  uint64_t stamp;
+  int32_t group;
+  int32_t depth;
+  int32_t stack[K808_MAX_LAYER_DEPTH];
+  uint32_t checksum;
+};
+
+// On-disk layout; the compiled tables directly follow the slots.
+struct snapshot_file {
+  struct snapshot_header header;
+  struct snapshot_default_stack defaults;
+  struct snapshot_slot slots[SNAPSHOT_MAX_DEVICES];
+};
+
+struct snapshot {
+  FILE *logger;
+  int fd;
+  struct snapshot_file *map;
+  size_t map_size;
+  struct snapshot_file *previous;
+};
+
+static void snapshot_log(FILE *fd, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  vfprintf(fd, fmt, args);
+  va_end(args);
+}
+
+static uint32_t header_checksum(const struct snapshot_header *header) {
+  struct snapshot_header copy;
+  memcpy(&copy, header, sizeof(copy)); // unlike assignment, this keeps the padding bytes
+  copy.checksum = 0;
+  return hash_bytes(HASH_SEED, &copy, sizeof(copy));
+}
+
+static uint32_t slot_checksum(const struct snapshot_slot *slot) {
+  return hash_bytes(HASH_SEED, slot, offsetof(struct snapshot_slot, checksum));
+}
+
+static uint32_t defaults_checksum(const struct snapshot_default_stack *defaults) {
+  return hash_bytes(HASH_SEED, defaults, offsetof(struct snapshot_default_stack, checksum));
+}
+
+static int valid_stack(const int32_t depth, const int32_t *stack) {
+  if (depth < 1 || depth > K808_MAX_LAYER_DEPTH) return 0;
+  for (int i = 0; i < depth; i++) {
+    if (stack[i] < 0) return 0;
+  }
+  return 1;
+}
+
+static int valid_file(const struct snapshot_file *file, const size_t size) {
+  const struct snapshot_header *h = &file->header;
+  return memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) == 0 &&
+         h->version == SNAPSHOT_VERSION &&
+         h->size == size &&
+         h->device_count <= SNAPSHOT_MAX_DEVICES &&
+         h->tables_len == size - sizeof(struct snapshot_file) &&
+         h->checksum == header_checksum(h) &&
+         h->tables_checksum == hash_bytes(HASH_SEED, file + 1, h->tables_len);
+}
+
+struct snapshot *snapshot_open(const char *path, FILE *logger) {
+  const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    snapshot_log(logger, "[K808 ERROR]: Can't open state file %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  struct snapshot *res = malloc(sizeof(struct snapshot));
+  res->logger = logger;
+  res->fd = fd;
+  res->map = NULL;
+  res->map_size = 0;
+  res->previous = NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct snapshot_file)) return res;
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) return res;
+
+  // keep a private copy: commit rewrites the mapping, but restoring reads from the old state
+  if (valid_file(map, st.st_size)) {
+    res->previous = malloc(st.st_size);
+    if (res->previous != NULL) {
+      memcpy(res->previous, map, st.st_size);
+      snapshot_log(logger, "[K808 INFO]: Loaded state file %s (%u devices, %lu bytes of tables).\n",
+        path, res->previous->header.device_count, res->previous->header.tables_len);
+    }
+  }
+  else {
+    snapshot_log(logger, "[K808 INFO]: Ignoring stale or corrupt state file %s.\n", path);
+  }
+  munmap(map, st.st_size);
+  return res;
+}
+
+int snapshot_valid(const struct snapshot *snap) {
+  return snap != NULL && snap->previous != NULL;
+}
+
+int snapshot_defaults(const struct snapshot *snap, int *stack) {
+  if (!snapshot_valid(snap)) return 0;
+  const struct snapshot_default_stack *defaults = &snap->previous->defaults;
+  if (defaults->checksum != defaults_checksum(defaults) || !valid_stack(defaults->depth, defaults->stack)) return 0;
+  memcpy(stack, defaults->stack, defaults->depth * sizeof(int));
+  return defaults->depth;
+}
+
+int snapshot_device_count(const struct snapshot *snap) {
+  return snapshot_valid(snap) ? (int)snap->previous->header.device_count : 0;
+}
+
+const char *snapshot_device_path(const struct snapshot *snap, const int n) {
+  if (n < 0 || n >= snapshot_device_count(snap)) return NULL;
+  return snap->previous->slots[n].path;
+}
+
+static const struct snapshot_slot *usable_slot(const struct snapshot *snap, const int n) {
+  const struct snapshot_slot *slot = &snap->previous->slots[n];
+  if (slot->checksum != slot_checksum(slot) || !valid_stack(slot->depth, slot->stack)) return NULL;
+  return slot;
+}
+
+int snapshot_find_device(const struct snapshot *snap, const char *path, int *group, int *stack) {
+  for (int i = 0; i < snapshot_device_count(snap); i++) {
+    const struct snapshot_slot *slot = usable_slot(snap, i);
+    if (slot == NULL || strncmp(slot->path, path, SNAPSHOT_PATH_LEN) != 0) continue;
+
+    *group = slot->group;
+    memcpy(stack, slot->stack, slot->depth * sizeof(int));
+    return slot->depth;
+  }
+  return 0;
+}
+
+// Group members all persist the shared stack; the most recently written copy wins.
+int snapshot_find_group(const struct snapshot *snap, const int group, int *stack) {
+  const struct snapshot_slot *best = NULL;
+  for (int i = 0; i < snapshot_device_count(snap); i++) {
+    const struct snapshot_slot *slot = usable_slot(snap, i);
+    if (slot != NULL && slot->group == group && (best == NULL || slot->stamp > best->stamp)) best = slot;
+  }
+
+  if (best == NULL) return 0;
+  memcpy(stack, best->stack, best->depth * sizeof(int));
+  return best->depth;
+}
+
+const void *snapshot_tables(const struct snapshot *snap, uint32_t *fingerprint, size_t *len) {
+  if (!snapshot_valid(snap)) return NULL;
+  *fingerprint = snap->previous->header.fingerprint;
+  *len = snap->previous->header.tables_len;
+  return snap->previous + 1;
+}
+
+int snapshot_commit(struct snapshot *snap, const char *const *paths, const int count, const uint32_t fingerprint,
+                    const void *tables, const size_t len) {
+  const size_t size = sizeof(struct snapshot_file) + len;
+  if (snap->map != NULL) {
+    munmap(snap->map, snap->map_size);
+    snap->map = NULL;
+  }
+  if (ftruncate(snap->fd, size) < 0) {
+    snapshot_log(snap->logger, "[K808 ERROR]: Can't resize state file: %s\n", strerror(errno));
+    return -1;
+  }
+
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, snap->fd, 0);
+  if (map == MAP_FAILED) {
+    snapshot_log(snap->logger, "[K808 ERROR]: Can't map state file: %s\n", strerror(errno));
+    return -1;
+  }
+  snap->map = map;
+  snap->map_size = size;
+
+  memset(snap->map, 0, sizeof(struct snapshot_file));
+  struct snapshot_header *h = &snap->map->header;
+  memcpy(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic));
+  h->version = SNAPSHOT_VERSION;
+  h->size = size;
+  h->device_count = count < SNAPSHOT_MAX_DEVICES ? count : SNAPSHOT_MAX_DEVICES;
+  h->fingerprint = fingerprint;
+  h->tables_len = len;
+
+  for (uint32_t i = 0; i < h->device_count; i++) {
+    strncpy(snap->map->slots[i].path, paths[i], SNAPSHOT_PATH_LEN - 1);
+    snap->map->slots[i].group = -1;
+  }
+
+  if (len > 0) memcpy(snap->map + 1, tables, len);
+  h->tables_checksum = hash_bytes(HASH_SEED, snap->map + 1, len);
+  h->checksum = header_checksum(h);
+  return 0;
+}
+
+void snapshot_store_defaults(struct snapshot *snap, const int *stack, const int depth) {
+  if (snap == NULL || snap->map == NULL) return;
+
+  struct snapshot_default_stack *defaults = &snap->map->defaults;
+  defaults->depth = depth;
+  memcpy(defaults->stack, stack, depth * sizeof(int));
+  defaults->checksum = defaults_checksum(defaults);
+}
+
+void snapshot_store_device(struct snapshot *snap, const int n, const int group, const int *stack, const int depth) {
+  if (snap == NULL || snap->map == NULL || n < 0 || (uint32_t)n >= snap->map->header.device_count) return;
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  struct snapshot_slot *slot = &snap->map->slots[n];
+  slot->stamp = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  slot->group = group;
+  slot->depth = depth;
+  memcpy(slot->stack, stack, depth * sizeof(int));
+  slot->checksum = slot_checksum(slot);
+}
+
+void free_snapshot(struct snapshot *snap) {
+  if (snap == NULL) return;
+  if (snap->map != NULL) {
+    msync(snap->map, snap->map_size, MS_SYNC);
+    munmap(snap->map, snap->map_size);
+  }
+  close(snap->fd);
+  free(snap->previous);
+  free(snap);
+}
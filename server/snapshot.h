@@ -0,0 +1,33 @@
+//
+// Created by jay on 1/9/25.
+//
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "k808_context.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_MAX_DEVICES 64
+#define SNAPSHOT_PATH_LEN 128
+
+struct snapshot;
+
+struct snapshot *snapshot_open(const char *path, FILE *logger);
+int snapshot_valid(const struct snapshot *snap);
+int snapshot_defaults(const struct snapshot *snap, int *stack);
+int snapshot_device_count(const struct snapshot *snap);
+const char *snapshot_device_path(const struct snapshot *snap, int n);
+int snapshot_find_device(const struct snapshot *snap, const char *path, int *group, int *stack);
+int snapshot_find_group(const struct snapshot *snap, int group, int *stack);
+const void *snapshot_tables(const struct snapshot *snap, uint32_t *fingerprint, size_t *len);
+int snapshot_commit(struct snapshot *snap, const char *const *paths, int count, uint32_t fingerprint, const void *tables, size_t len);
+void snapshot_store_defaults(struct snapshot *snap, const int *stack, int depth);
+void snapshot_store_device(struct snapshot *snap, int n, int group, const int *stack, int depth);
+void free_snapshot(struct snapshot *snap);
+
+#endif //SNAPSHOT_H
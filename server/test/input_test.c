@@ -0,0 +1,128 @@
+//
+// Created by jay on 1/14/25.
+//
+
+#include "../input.h"
+#include "test.h"
+
+#include <string.h>
+
+static struct input_key received[256];
+static int received_count;
+static int handler_calls;
+static int resyncs;
+
+static void on_frame(const struct input_key *keys, const int count, void *) {
+  for (int i = 0; i < count && received_count < 256; i++) received[received_count++] = keys[i];
+  handler_calls++;
+}
+
+static void on_resync(void *) {
+  resyncs++;
+}
+
+static void reset(struct input_frame *frame) {
+  memset(frame, 0, sizeof(*frame));
+  received_count = 0;
+  handler_calls = 0;
+  resyncs = 0;
+}
+
+static struct input_event key(const uint16_t code, const int32_t value) {
+  return (struct input_event){ .type = EV_KEY, .code = code, .value = value };
+}
+
+static struct input_event syn(const uint16_t code) {
+  return (struct input_event){ .type = EV_SYN, .code = code, .value = 0 };
+}
+
+static void test_decode_table(void) {
+  // both code sets the keypad can send
+  CHECK_EQ(input_key_of(KEY_KP1), K808_1);
+  CHECK_EQ(input_key_of(KEY_A), K808_1);
+  CHECK_EQ(input_key_of(KEY_KP7), K808_7);
+  CHECK_EQ(input_key_of(KEY_J), K808_7);
+  CHECK_EQ(input_key_of(KEY_KP0), K808_0);
+  CHECK_EQ(input_key_of(KEY_K), K808_0);
+  CHECK_EQ(input_key_of(KEY_KPDOT), K808_DOT);
+  CHECK_EQ(input_key_of(KEY_KPENTER), K808_ENTER);
+
+  CHECK_EQ(input_key_of(KEY_RESERVED), -1);
+  CHECK_EQ(input_key_of(KEY_S), -1);
+  CHECK_EQ(input_key_of(KEY_VOLUMEUP), -1);
+  CHECK_EQ(input_key_of(BTN_LEFT), -1);
+}
+
+static void test_frames(void) {
+  struct input_frame frame;
+  reset(&frame);
+
+  // a frame split across two reads is only handed over once it's complete; other event types are ignored
+  const struct input_event first[] = {
+    { .type = EV_MSC, .code = MSC_SCAN, .value = 0x70059 }, key(KEY_KP1, 1), key(KEY_S, 1),
+  };
+  const struct input_event second[] = { syn(SYN_REPORT), key(KEY_KPENTER, 2), syn(SYN_REPORT) };
+  CHECK_EQ(input_decode(&frame, first, 3, on_frame, on_resync, NULL), 0);
+  CHECK_EQ(handler_calls, 0);
+  CHECK_EQ(input_decode(&frame, second, 3, on_frame, on_resync, NULL), 2);
+
+  CHECK_EQ(handler_calls, 2);
+  CHECK_EQ(received_count, 3);
+  CHECK_EQ(received[0].key, K808_1);
+  CHECK_EQ(received[0].value, 1);
+  CHECK_EQ(received[1].key, -1); // unknown codes are passed on, so they can be counted
+  CHECK_EQ(received[1].code, KEY_S);
+  CHECK_EQ(received[2].key, K808_ENTER);
+  CHECK_EQ(received[2].value, 2);
+
+  // empty frames aren't handed over
+  reset(&frame);
+  const struct input_event empty[] = { syn(SYN_REPORT), syn(SYN_REPORT) };
+  CHECK_EQ(input_decode(&frame, empty, 2, on_frame, on_resync, NULL), 2);
+  CHECK_EQ(handler_calls, 0);
+}
+
+static void test_overflow(void) {
+  struct input_frame frame;
+  reset(&frame);
+
+  // everything from the open frame up to the SYN_REPORT after the drop is discarded, then the state is resynced
+  const struct input_event events[] = {
+    key(KEY_KP2, 1), syn(SYN_DROPPED), key(KEY_KP3, 1), syn(SYN_REPORT), key(KEY_KP4, 1), syn(SYN_REPORT),
+  };
+  CHECK_EQ(input_decode(&frame, events, 6, on_frame, on_resync, NULL), 1);
+  CHECK_EQ(resyncs, 1);
+  CHECK_EQ(received_count, 1);
+  CHECK_EQ(received[0].key, K808_4);
+
+  // the drop can span reads
+  reset(&frame);
+  const struct input_event dropped[] = { syn(SYN_DROPPED), key(KEY_KP5, 1) };
+  const struct input_event rest[] = { key(KEY_KP6, 1), syn(SYN_REPORT) };
+  input_decode(&frame, dropped, 2, on_frame, on_resync, NULL);
+  CHECK_EQ(resyncs, 0);
+  CHECK_EQ(input_decode(&frame, rest, 2, on_frame, NULL, NULL), 0); // and resync is optional
+  CHECK_EQ(received_count, 0);
+  CHECK_EQ(frame.dropping, 0);
+}
+
+static void test_long_frame(void) {
+  struct input_frame frame;
+  reset(&frame);
+
+  // a frame with more keys than fit is handed over in parts, nothing is lost
+  struct input_event events[INPUT_BATCH + 11];
+  for (int i = 0; i < INPUT_BATCH + 10; i++) events[i] = key(KEY_KP1, i % 2);
+  events[INPUT_BATCH + 10] = syn(SYN_REPORT);
+  CHECK_EQ(input_decode(&frame, events, INPUT_BATCH + 11, on_frame, on_resync, NULL), 1);
+  CHECK_EQ(handler_calls, 2);
+  CHECK_EQ(received_count, INPUT_BATCH + 10);
+}
+
+int main(void) {
+  test_decode_table();
+  test_frames();
+  test_overflow();
+  test_long_frame();
+  return TEST_RESULT();
+}
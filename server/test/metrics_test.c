@@ -0,0 +1,80 @@
+//
+// Created by jay on 1/14/25.
+//
+
+#include "../metrics.h"
+#include "test.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#define THREADS 8
+#define ADDS 100000
+
+static void *device_thread(void *arg) {
+  const int device = (int)(long)arg;
+  metrics_bind_device(device);
+  for (int i = 0; i < ADDS; i++) metrics_add(METRIC_EVENTS_READ, 1);
+  metrics_add(METRIC_INPUT_OVERFLOWS, device);
+  return NULL;
+}
+
+static void test_aggregation(void) {
+  pthread_t threads[THREADS];
+  for (long i = 0; i < THREADS; i++) pthread_create(threads + i, NULL, device_thread, (void *)i);
+  // the main thread counts into the shared shard at the same time
+  for (int i = 0; i < ADDS; i++) metrics_add(METRIC_EVENTS_READ, 1);
+  for (int i = 0; i < THREADS; i++) pthread_join(threads[i], NULL);
+
+  CHECK_EQ(metrics_get(METRIC_EVENTS_READ), (int64_t)(THREADS + 1) * ADDS);
+  CHECK_EQ(metrics_get(METRIC_INPUT_OVERFLOWS), THREADS * (THREADS - 1) / 2);
+  CHECK_EQ(metrics_get(METRIC_UNKNOWN_CODES), 0);
+}
+
+static void test_shared_shards(void) {
+  // devices beyond the last shard share one; the total stays exact
+  const int64_t before = metrics_get(METRIC_HANDLER_MISSES);
+  metrics_bind_device(3);
+  metrics_add(METRIC_HANDLER_MISSES, 5);
+  metrics_bind_device(3 + METRICS_SHARDS - 1);
+  metrics_add(METRIC_HANDLER_MISSES, 7);
+  CHECK_EQ(metrics_get(METRIC_HANDLER_MISSES) - before, 12);
+}
+
+static void test_export(void) {
+  static char text[16384];
+  const size_t len = metrics_export(text, sizeof(text));
+  CHECK(len > 0 && len < sizeof(text));
+  CHECK_EQ(strlen(text), len);
+
+  char line[128];
+  // per-device counters get one series per device shard, the others a single total
+  snprintf(line, sizeof(line), "k808_events_read_total{device=\"3\"} %d\n", ADDS);
+  CHECK(strstr(text, line) != NULL);
+  snprintf(line, sizeof(line), "k808_input_overflows_total{device=\"7\"} %d\n", 7);
+  CHECK(strstr(text, line) != NULL);
+  CHECK(strstr(text, "# TYPE k808_events_read_total counter\n") != NULL);
+  CHECK(strstr(text, "# TYPE k808_control_connections gauge\n") != NULL);
+  CHECK(strstr(text, "\nk808_rejected_messages_total 0\n") != NULL);
+
+  // like snprintf: a short buffer gets a terminated prefix, and the length that was needed
+  char small[64];
+  CHECK_EQ(metrics_export(small, sizeof(small)), len);
+  CHECK_EQ(strlen(small), sizeof(small) - 1);
+  CHECK_EQ(strncmp(small, text, sizeof(small) - 1), 0);
+}
+
+static void test_gauges(void) {
+  metrics_add(METRIC_CONNECTIONS, 1);
+  metrics_add(METRIC_CONNECTIONS, 1);
+  metrics_add(METRIC_CONNECTIONS, -1);
+  CHECK_EQ(metrics_get(METRIC_CONNECTIONS), 1);
+}
+
+int main(void) {
+  test_aggregation();
+  test_export();
+  test_shared_shards();
+  test_gauges();
+  return TEST_RESULT();
+}
@@ -0,0 +1,180 @@
+//
+// Created by jay on 1/14/25.
+//
+
+#include "protocol.h"
+#include "test.h"
+
+#include <string.h>
+
+static void test_round_trip(void) {
+  char buf[256];
+  struct proto_builder b;
+  proto_begin(&b, buf, sizeof(buf), 808);
+
+  const uint32_t layer = 2;
+  const uint32_t args[] = { (uint32_t)-1, 1 };
+  CHECK_EQ(proto_add(&b, PROTO_OP_PING, PROTO_OK, NULL, 0), 0);
+  CHECK_EQ(proto_add(&b, PROTO_OP_PUSH_LAYER, PROTO_OK, &layer, sizeof(layer)), 0);
+  CHECK_EQ(proto_add(&b, PROTO_OP_SWITCH_LAYER, PROTO_ERR_FAILED, args, sizeof(args)), 0);
+  CHECK_EQ(proto_count(&b), 3);
+
+  const size_t len = proto_finish(&b);
+  CHECK_EQ(len, sizeof(struct proto_header) + 3 * sizeof(struct proto_entry) + sizeof(layer) + sizeof(args));
+
+  // frames share the v1 framing: magic, then the length of everything after it
+  uint32_t framed;
+  memcpy(&framed, buf + 4, sizeof(framed));
+  CHECK_EQ(framed + 8, len);
+
+  struct proto_message msg;
+  CHECK_EQ(proto_parse(buf, len, &msg), 0);
+  CHECK_EQ(msg.request_id, 808);
+  CHECK_EQ(msg.count, 3);
+
+  size_t off = 0;
+  struct proto_entry entry;
+  const char *data;
+  CHECK_EQ(proto_next(&msg, &off, &entry, &data), 1);
+  CHECK_EQ(entry.opcode, PROTO_OP_PING);
+  CHECK_EQ(entry.length, 0);
+
+  CHECK_EQ(proto_next(&msg, &off, &entry, &data), 1);
+  CHECK_EQ(entry.opcode, PROTO_OP_PUSH_LAYER);
+  CHECK_EQ(entry.length, sizeof(layer));
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  CHECK_EQ(value, layer);
+
+  CHECK_EQ(proto_next(&msg, &off, &entry, &data), 1);
+  CHECK_EQ(entry.opcode, PROTO_OP_SWITCH_LAYER);
+  CHECK_EQ(entry.status, PROTO_ERR_FAILED);
+  CHECK_EQ(memcmp(data, args, sizeof(args)), 0);
+
+  CHECK_EQ(proto_next(&msg, &off, &entry, &data), 0);
+}
+
+static void test_malformed_frames(void) {
+  char buf[128];
+  struct proto_builder b;
+  proto_begin(&b, buf, sizeof(buf), 1);
+  const uint32_t layer = 1;
+  proto_add(&b, PROTO_OP_PUSH_LAYER, PROTO_OK, &layer, sizeof(layer));
+  const size_t len = proto_finish(&b);
+
+  struct proto_message msg;
+  CHECK_EQ(proto_parse(buf, len - 1, &msg), -1);               // length doesn't match the frame
+  CHECK_EQ(proto_parse(buf, sizeof(struct proto_header) - 1, &msg), -1);
+
+  char copy[128];
+  memcpy(copy, buf, len);
+  memcpy(copy, "K808", 4);                                     // a v1 frame
+  CHECK_EQ(proto_parse(copy, len, &msg), -1);
+  memcpy(copy, buf, len);
+  copy[offsetof(struct proto_header, version)] = PROTO_VERSION + 1;
+  CHECK_EQ(proto_parse(copy, len, &msg), -1);
+
+  // an entry claiming more data than the frame holds
+  memcpy(copy, buf, len);
+  const uint32_t bogus = 64;
+  memcpy(copy + sizeof(struct proto_header) + offsetof(struct proto_entry, length), &bogus, sizeof(bogus));
+  CHECK_EQ(proto_parse(copy, len, &msg), 0);
+  size_t off = 0;
+  struct proto_entry entry;
+  const char *data;
+  CHECK_EQ(proto_next(&msg, &off, &entry, &data), -1);
+
+  // trailing bytes too short for an entry header
+  memcpy(copy, buf, len);
+  memset(copy + len, 0, 3);
+  const uint32_t longer = len + 3 - 8;
+  memcpy(copy + 4, &longer, sizeof(longer));
+  CHECK_EQ(proto_parse(copy, len + 3, &msg), 0);
+  off = 0;
+  CHECK_EQ(proto_next(&msg, &off, &entry, &data), 1);
+  CHECK_EQ(proto_next(&msg, &off, &entry, &data), -1);
+}
+
+static void test_validate(void) {
+  char buf[128];
+  struct proto_builder b;
+  proto_begin(&b, buf, sizeof(buf), 77);
+  const uint32_t args[] = { (uint32_t)-1, 0 };
+  proto_add(&b, PROTO_OP_SWITCH_LAYER, PROTO_OK, args, sizeof(args));
+  proto_add(&b, PROTO_OP_PING, PROTO_OK, NULL, 0);
+  const size_t len = proto_finish(&b);
+
+  struct proto_message msg;
+  CHECK_EQ(proto_parse(buf, len, &msg), 0);
+  CHECK_EQ(proto_validate(&msg), 0);
+
+  // a good entry followed by 3 bytes that can't be one: the frame parses, but the batch as a whole is refused
+  char copy[128];
+  memcpy(copy, buf, len);
+  memset(copy + len, 0, 3);
+  uint32_t longer = len + 3 - 8;
+  memcpy(copy + 4, &longer, sizeof(longer));
+  CHECK_EQ(proto_parse(copy, len + 3, &msg), 0);
+  CHECK_EQ(msg.request_id, 77);
+  CHECK_EQ(proto_validate(&msg), -1);
+
+  // a good entry followed by one whose data runs past the frame
+  memcpy(copy, buf, len);
+  const struct proto_entry bad = { .opcode = PROTO_OP_PUSH_LAYER, .status = PROTO_OK, .length = 4 };
+  memcpy(copy + len, &bad, sizeof(bad));
+  longer = len + sizeof(bad) - 8;
+  memcpy(copy + 4, &longer, sizeof(longer));
+  CHECK_EQ(proto_parse(copy, len + sizeof(bad), &msg), 0);
+  CHECK_EQ(proto_validate(&msg), -1);
+
+  // intact entries, but not as many as the header claims
+  memcpy(copy, buf, len);
+  const uint16_t count = 3;
+  memcpy(copy + offsetof(struct proto_header, count), &count, sizeof(count));
+  CHECK_EQ(proto_parse(copy, len, &msg), 0);
+  CHECK_EQ(proto_validate(&msg), -1);
+}
+
+static void test_full_frame(void) {
+  char buf[sizeof(struct proto_header) + 2 * sizeof(struct proto_entry) + 8];
+  struct proto_builder b;
+  proto_begin(&b, buf, sizeof(buf), 7);
+  CHECK_EQ(proto_space(&b), 2 * sizeof(struct proto_entry) + 8);
+
+  const char payload[16] = "0123456789abcdef";
+  CHECK_EQ(proto_add(&b, PROTO_OP_GET_METRICS, PROTO_OK, payload, 8), 0);
+  CHECK_EQ(proto_space(&b), sizeof(struct proto_entry));
+
+  // an entry that doesn't fit leaves the frame as it was; one that does still goes in
+  CHECK_EQ(proto_add(&b, PROTO_OP_GET_METRICS, PROTO_OK, payload, 1), -1);
+  CHECK_EQ(proto_count(&b), 1);
+  CHECK_EQ(proto_add(&b, PROTO_OP_GET_METRICS, PROTO_ERR_OVERFLOW, NULL, 0), 0);
+  CHECK_EQ(proto_space(&b), 0);
+
+  struct proto_message msg;
+  CHECK_EQ(proto_parse(buf, proto_finish(&b), &msg), 0);
+  CHECK_EQ(msg.count, 2);
+
+  // a buffer too small for even the header fails every call
+  char tiny[4];
+  proto_begin(&b, tiny, sizeof(tiny), 0);
+  CHECK_EQ(proto_add(&b, PROTO_OP_PING, PROTO_OK, NULL, 0), -1);
+  CHECK_EQ(proto_space(&b), 0);
+  CHECK_EQ(proto_finish(&b), 0);
+}
+
+static void test_status_names(void) {
+  CHECK_EQ(strcmp(proto_status_name(PROTO_OK), "ok"), 0);
+  CHECK_EQ(strcmp(proto_status_name(PROTO_ERR_OVERFLOW), "response too large"), 0);
+  CHECK_EQ(strcmp(proto_status_name(PROTO_ERR_MALFORMED), "malformed request"), 0);
+  CHECK_EQ(strcmp(proto_status_name(0xffff), "unknown status"), 0);
+}
+
+int main(void) {
+  test_round_trip();
+  test_malformed_frames();
+  test_validate();
+  test_full_frame();
+  test_status_names();
+  return TEST_RESULT();
+}
@@ -0,0 +1,174 @@
+//
+// Created by jay on 1/14/25.
+//
+
+#include "../sequence.h"
+#include "test.h"
+
+#include <string.h>
+
+#define TIMEOUT_MS 100
+
+static int fired[2];
+static int fired_count;
+
+// replayed key events, in order, as (key << 1 | is_press)
+static int replayed[32];
+static int replay_count;
+
+static void on_sequence(const enum k808_key *, const int count, void *user_data) {
+  fired[(long)user_data]++;
+  fired_count = count;
+}
+
+static void on_replay(const enum k808_key key, const enum k808_event event, void *) {
+  if (replay_count < 32) replayed[replay_count++] = key << 1 | (event == K808_KEY_PRESS);
+}
+
+static void reset_counters(void) {
+  memset(fired, 0, sizeof(fired));
+  fired_count = 0;
+  replay_count = 0;
+}
+
+static int feed(const struct sequence_table *table, struct sequence_state *state, const enum k808_key key,
+                const enum k808_event event, const uint64_t now_ms) {
+  return sequence_feed(table, state, key, event, now_ms, on_replay, NULL);
+}
+
+// ENTER 4 2 fires sequence 0; its prefix ENTER 4 is sequence 1.
+static struct sequence_table *make_table(void) {
+  struct sequence_table *table = init_sequence_table();
+  const enum k808_key full[] = { K808_ENTER, K808_4, K808_2 };
+  const enum k808_key prefix[] = { K808_ENTER, K808_4 };
+  sequence_table_add(table, full, 3, on_sequence, (void *)0);
+  sequence_table_add(table, prefix, 2, on_sequence, (void *)1);
+  sequence_table_set_timeout(table, TIMEOUT_MS);
+  return table;
+}
+
+static void test_full_match(const struct sequence_table *table) {
+  struct sequence_state state = { 0 };
+  reset_counters();
+
+  CHECK(feed(table, &state, K808_ENTER, K808_KEY_PRESS, 0));
+  CHECK(feed(table, &state, K808_ENTER, K808_KEY_RELEASE, 1));
+  CHECK(feed(table, &state, K808_4, K808_KEY_PRESS, 2));
+  CHECK(feed(table, &state, K808_4, K808_KEY_RELEASE, 3));
+  CHECK(feed(table, &state, K808_2, K808_KEY_PRESS, 4));
+  CHECK_EQ(fired[0], 1);
+  CHECK_EQ(fired[1], 0);
+  CHECK_EQ(fired_count, 3);
+
+  // the last key was still down when the sequence fired; its release is swallowed, not passed on
+  CHECK(sequence_owns(&state, K808_2));
+  CHECK(feed(table, &state, K808_2, K808_KEY_RELEASE, 5));
+  CHECK(!sequence_owns(&state, K808_2));
+  CHECK_EQ(replay_count, 0);
+}
+
+static void test_prefix_timeout(const struct sequence_table *table) {
+  struct sequence_state state = { 0 };
+  reset_counters();
+
+  feed(table, &state, K808_ENTER, K808_KEY_PRESS, 0);
+  feed(table, &state, K808_ENTER, K808_KEY_RELEASE, 1);
+  feed(table, &state, K808_4, K808_KEY_PRESS, 2);
+  feed(table, &state, K808_4, K808_KEY_RELEASE, 3);
+
+  sequence_poll(table, &state, 2 + TIMEOUT_MS - 1, on_replay, NULL);
+  CHECK_EQ(fired[1], 0);
+  sequence_poll(table, &state, 2 + TIMEOUT_MS, on_replay, NULL);
+  CHECK_EQ(fired[1], 1);
+  CHECK_EQ(fired[0], 0);
+  CHECK_EQ(fired_count, 2);
+}
+
+static void test_prefix_interrupted(const struct sequence_table *table) {
+  struct sequence_state state = { 0 };
+  reset_counters();
+
+  // ENTER 4 can't continue with 5: the prefix's own sequence fires and 5 isn't taken by the matcher
+  feed(table, &state, K808_ENTER, K808_KEY_PRESS, 0);
+  feed(table, &state, K808_ENTER, K808_KEY_RELEASE, 1);
+  feed(table, &state, K808_4, K808_KEY_PRESS, 2);
+  feed(table, &state, K808_4, K808_KEY_RELEASE, 3);
+  CHECK(!feed(table, &state, K808_5, K808_KEY_PRESS, 4));
+  CHECK_EQ(fired[1], 1);
+  CHECK_EQ(replay_count, 0);
+}
+
+static void test_replay(const struct sequence_table *table) {
+  struct sequence_state state = { 0 };
+  reset_counters();
+
+  // ENTER alone isn't a sequence, so it's replayed once 5 shows it can't become one
+  feed(table, &state, K808_ENTER, K808_KEY_PRESS, 0);
+  feed(table, &state, K808_ENTER, K808_KEY_RELEASE, 1);
+  CHECK(!feed(table, &state, K808_5, K808_KEY_PRESS, 2));
+  CHECK_EQ(fired[0] + fired[1], 0);
+  CHECK_EQ(replay_count, 2);
+  CHECK_EQ(replayed[0], K808_ENTER << 1 | 1);
+  CHECK_EQ(replayed[1], K808_ENTER << 1);
+
+  // a key that's still held when it's replayed only gets its press; the real release passes through afterwards
+  reset_counters();
+  feed(table, &state, K808_ENTER, K808_KEY_PRESS, 10);
+  sequence_poll(table, &state, 10 + TIMEOUT_MS, on_replay, NULL);
+  CHECK_EQ(replay_count, 1);
+  CHECK_EQ(replayed[0], K808_ENTER << 1 | 1);
+  CHECK(!feed(table, &state, K808_ENTER, K808_KEY_RELEASE, 20 + TIMEOUT_MS));
+}
+
+static void test_unrelated_keys(const struct sequence_table *table) {
+  struct sequence_state state = { 0 };
+  reset_counters();
+
+  CHECK(!feed(table, &state, K808_1, K808_KEY_PRESS, 0));
+  CHECK(!feed(table, &state, K808_1, K808_KEY_RELEASE, 1));
+  CHECK_EQ(fired[0] + fired[1] + replay_count, 0);
+}
+
+static void test_export_import(const struct sequence_table *table) {
+  const size_t len = sequence_table_export(table, NULL, 0);
+  CHECK_EQ(len > 0, 1);
+  char *tables = malloc(len);
+  CHECK_EQ(sequence_table_export(table, tables, len), len);
+
+  // the same registrations give the same fingerprint and accept the exported nodes
+  struct sequence_table *copy = make_table();
+  CHECK_EQ(sequence_table_fingerprint(copy), sequence_table_fingerprint(table));
+  CHECK_EQ(sequence_table_import(copy, tables, len), 0);
+  CHECK_EQ(sequence_table_node_count(copy), sequence_table_node_count(table));
+  test_full_match(copy);
+
+  // truncated or corrupt tables are refused
+  CHECK_EQ(sequence_table_import(copy, tables, len - 1), -1);
+  memset(tables, 0x7f, sizeof(int32_t));
+  CHECK_EQ(sequence_table_import(copy, tables, len), -1);
+
+  // different registrations never share a fingerprint
+  const enum k808_key other[] = { K808_1, K808_2 };
+  sequence_table_add(copy, other, 2, on_sequence, (void *)0);
+  CHECK(sequence_table_fingerprint(copy) != sequence_table_fingerprint(table));
+
+  free_sequence_table(copy);
+  free(tables);
+}
+
+int main(void) {
+  struct sequence_table *table = make_table();
+  CHECK_EQ(sequence_table_compile(table), 0);
+  CHECK_EQ(sequence_table_size(table), 2);
+  CHECK_EQ(sequence_table_node_count(table), 4);
+
+  test_full_match(table);
+  test_prefix_timeout(table);
+  test_prefix_interrupted(table);
+  test_replay(table);
+  test_unrelated_keys(table);
+  test_export_import(table);
+
+  free_sequence_table(table);
+  return TEST_RESULT();
+}
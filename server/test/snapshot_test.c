@@ -0,0 +1,153 @@
+//
+// Created by jay on 1/14/25.
+//
+
+// Included rather than linked, so the tests can damage specific parts of the on-disk layout.
+#include "../snapshot.c"
+#include "test.h"
+
+static const char *const paths[] = { "/dev/input/event5", "/dev/input/event6", "/dev/input/event7" };
+static const char tables[] = "compiled sequence tables";
+static FILE *logger;
+
+static struct snapshot *reopen(const char *path) {
+  return snapshot_open(path, logger);
+}
+
+static void write_state(const char *path) {
+  unlink(path);
+  struct snapshot *snap = reopen(path);
+  CHECK(snap != NULL);
+  CHECK(!snapshot_valid(snap));
+  CHECK_EQ(snapshot_commit(snap, paths, 3, 0x808, tables, sizeof(tables)), 0);
+
+  const int defaults[] = { 0, 2 };
+  const int solo[] = { 1 };
+  const int group_old[] = { 0, 1, 3 };
+  const int group_new[] = { 2 };
+  snapshot_store_defaults(snap, defaults, 2);
+  snapshot_store_device(snap, 0, -1, solo, 1);
+  snapshot_store_device(snap, 1, 4, group_old, 3);
+  snapshot_store_device(snap, 2, 4, group_new, 1);
+  snapshot_store_device(snap, 3, -1, solo, 1); // past the committed devices, ignored
+  free_snapshot(snap);
+}
+
+// Flips one byte of the file at off.
+static void damage(const char *path, const long off) {
+  FILE *fp = fopen(path, "r+");
+  fseek(fp, off, SEEK_SET);
+  const int c = fgetc(fp);
+  fseek(fp, off, SEEK_SET);
+  fputc(c ^ 0x55, fp);
+  fclose(fp);
+}
+
+static void test_round_trip(const char *path) {
+  write_state(path);
+  struct snapshot *snap = reopen(path);
+  CHECK(snapshot_valid(snap));
+  CHECK_EQ(snapshot_device_count(snap), 3);
+  CHECK_EQ(strcmp(snapshot_device_path(snap, 1), paths[1]), 0);
+  CHECK(snapshot_device_path(snap, 3) == NULL);
+
+  int stack[K808_MAX_LAYER_DEPTH];
+  CHECK_EQ(snapshot_defaults(snap, stack), 2);
+  CHECK_EQ(stack[1], 2);
+
+  int group = 0;
+  CHECK_EQ(snapshot_find_device(snap, paths[0], &group, stack), 1);
+  CHECK_EQ(group, -1);
+  CHECK_EQ(stack[0], 1);
+  CHECK_EQ(snapshot_find_device(snap, paths[1], &group, stack), 3);
+  CHECK_EQ(group, 4);
+  CHECK_EQ(snapshot_find_device(snap, "/dev/input/event9", &group, stack), 0);
+
+  // group members all store the shared stack; the most recent write wins
+  CHECK_EQ(snapshot_find_group(snap, 4, stack), 1);
+  CHECK_EQ(stack[0], 2);
+  CHECK_EQ(snapshot_find_group(snap, 5, stack), 0);
+
+  uint32_t fingerprint;
+  size_t len;
+  const char *stored = snapshot_tables(snap, &fingerprint, &len);
+  CHECK_EQ(fingerprint, 0x808);
+  CHECK_EQ(len, sizeof(tables));
+  CHECK(stored != NULL && memcmp(stored, tables, sizeof(tables)) == 0);
+  free_snapshot(snap);
+}
+
+static void test_torn_slot(const char *path) {
+  write_state(path);
+  damage(path, offsetof(struct snapshot_file, slots[1]) + offsetof(struct snapshot_slot, stack));
+
+  // only that device's state is lost
+  struct snapshot *snap = reopen(path);
+  CHECK(snapshot_valid(snap));
+  int group, stack[K808_MAX_LAYER_DEPTH];
+  CHECK_EQ(snapshot_find_device(snap, paths[1], &group, stack), 0);
+  CHECK_EQ(snapshot_find_device(snap, paths[0], &group, stack), 1);
+  CHECK_EQ(snapshot_defaults(snap, stack), 2);
+  free_snapshot(snap);
+}
+
+static void test_torn_defaults(const char *path) {
+  write_state(path);
+  damage(path, offsetof(struct snapshot_file, defaults) + offsetof(struct snapshot_default_stack, stack));
+
+  struct snapshot *snap = reopen(path);
+  CHECK(snapshot_valid(snap));
+  int group, stack[K808_MAX_LAYER_DEPTH];
+  CHECK_EQ(snapshot_defaults(snap, stack), 0);
+  CHECK_EQ(snapshot_find_device(snap, paths[0], &group, stack), 1);
+  free_snapshot(snap);
+}
+
+static void test_corrupt_file(const char *path) {
+  // the header and the tables invalidate the whole file
+  write_state(path);
+  damage(path, offsetof(struct snapshot_header, device_count));
+  struct snapshot *snap = reopen(path);
+  CHECK(!snapshot_valid(snap));
+  CHECK_EQ(snapshot_device_count(snap), 0);
+  free_snapshot(snap);
+
+  write_state(path);
+  damage(path, sizeof(struct snapshot_file) + 3);
+  snap = reopen(path);
+  CHECK(!snapshot_valid(snap));
+  free_snapshot(snap);
+
+  write_state(path);
+  CHECK_EQ(truncate(path, sizeof(struct snapshot_file)), 0);
+  snap = reopen(path);
+  CHECK(!snapshot_valid(snap));
+
+  // a commit starts over from a clean file
+  CHECK_EQ(snapshot_commit(snap, paths, 1, 1, tables, sizeof(tables)), 0);
+  free_snapshot(snap);
+  snap = reopen(path);
+  CHECK(snapshot_valid(snap));
+  CHECK_EQ(snapshot_device_count(snap), 1);
+  free_snapshot(snap);
+}
+
+int main(void) {
+  char path[] = "/tmp/k808-snapshot-test-XXXXXX";
+  const int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return EXIT_FAILURE;
+  }
+  close(fd);
+  logger = fopen("/dev/null", "w");
+
+  test_round_trip(path);
+  test_torn_slot(path);
+  test_torn_defaults(path);
+  test_corrupt_file(path);
+
+  fclose(logger);
+  unlink(path);
+  return TEST_RESULT();
+}
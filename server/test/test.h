@@ -0,0 +1,32 @@
+//
+// Created by jay on 1/14/25.
+//
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Minimal assertions for the ctest executables: failures are reported and counted, and the test keeps going so one run
+// shows everything that's broken.
+static int test_failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      test_failures++; \
+    } \
+  } while (0)
+
+#define CHECK_EQ(actual, expected) do { \
+    const long long _actual = (long long)(actual), _expected = (long long)(expected); \
+    if (_actual != _expected) { \
+      fprintf(stderr, "%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, _actual, _expected); \
+      test_failures++; \
+    } \
+  } while (0)
+
+#define TEST_RESULT() (test_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE)
+
+#endif //TEST_H
@@ -0,0 +1,19 @@
+//
+// Created by jay on 1/6/25.
+//
+
+#ifndef TRACE_H
+#define TRACE_H
+
+// USDT probes under the "k808" provider, e.g. `bpftrace -l 'usdt:/usr/local/bin/k808:k808:*'`. When built without
+// K808_USDT (or without sys/sdt.h), they compile to nothing; when built in, a disabled probe is a single nop.
+#ifdef K808_USDT
+#include <sys/sdt.h>
+#define K808_TRACE(name, ...) STAP_PROBEV(k808, name, ##__VA_ARGS__)
+#else
+// The arguments still appear in an unevaluated sizeof, so values only passed to probes don't warn as unused.
+int k808_trace_args(int, ...);
+#define K808_TRACE(name, ...) ((void)sizeof(k808_trace_args(0, ##__VA_ARGS__)))
+#endif
+
+#endif //TRACE_H